@@ -21,8 +21,10 @@
 #include "hw/virtio-blk.h" // process_virtio_blk_op
 #include "hw/virtio-scsi.h" // virtio_scsi_process_op
 #include "hw/nvme.h" // nvme_process_op
+#include "list.h" // hlist_add_head
 #include "malloc.h" // malloc_low
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_loadint
 #include "stacks.h" // call32
 #include "std/disk.h" // struct dpte_s
 #include "string.h" // checksum
@@ -500,6 +502,245 @@ fill_edd(struct segoff_s edd, struct drive_s *drive_fl)
 }
 
 
+/****************************************************************
+ * Disk sector cache
+ ****************************************************************/
+
+// Bootloaders tend to re-read the same filesystem metadata sectors many
+// times.  Recently read sectors of small reads are kept in high memory so
+// that these re-reads do not go to the device.
+#define BCACHE_MAX_READ 8
+
+// Sequential reads are served from a read-ahead window once a stream of
+// them is detected.  The window must hold at least two of the largest
+// (127 sector) traditional requests; it is filled in as many driver
+// sized pieces as needed.
+#define READAHEAD_MAX_SECTORS 256
+#define READAHEAD_MIN_SECTORS 16
+
+struct bcache_entry_s {
+    struct hlist_node node;
+    struct drive_s *drive_fl;
+    u64 lba;
+    u32 lastuse;
+    u8 *data;
+};
+
+struct bcache_s {
+    struct hlist_head *buckets;
+    u32 bucketmask;
+    struct bcache_entry_s *entries;
+    u32 count;
+    u32 clock, hits, misses;
+
+    // Read-ahead state
+    struct drive_s *ra_drive_fl;
+    u64 ra_next, ra_lba;
+    u32 ra_streak, ra_count, ra_size, ra_hits;
+    u8 *ra_buf;
+};
+
+struct bcache_s *BlockCache VARFSEG;
+
+static void
+bcache_setup_sectors(struct bcache_s *bc)
+{
+    u32 count = romfile_loadint("etc/block-cache-sectors", 64);
+    if (!count)
+        return;
+    u32 nbuckets = 1;
+    while (nbuckets < count)
+        nbuckets <<= 1;
+
+    struct hlist_head *buckets = malloc_high(nbuckets * sizeof(*buckets));
+    struct bcache_entry_s *entries = malloc_high(count * sizeof(*entries));
+    u8 *data = malloc_high(count * DISK_SECTOR_SIZE);
+    if (!buckets || !entries || !data) {
+        warn_noalloc();
+        free(buckets);
+        free(entries);
+        free(data);
+        return;
+    }
+    memset(buckets, 0, nbuckets * sizeof(*buckets));
+    memset(entries, 0, count * sizeof(*entries));
+    u32 i;
+    for (i = 0; i < count; i++)
+        entries[i].data = data + i * DISK_SECTOR_SIZE;
+    bc->buckets = buckets;
+    bc->bucketmask = nbuckets - 1;
+    bc->entries = entries;
+    bc->count = count;
+    dprintf(1, "Disk sector cache: %d sectors\n", count);
+}
+
+static void
+bcache_setup_readahead(struct bcache_s *bc)
+{
+    u32 size = romfile_loadint("etc/block-readahead-sectors"
+                               , READAHEAD_MAX_SECTORS);
+    if (size > READAHEAD_MAX_SECTORS)
+        size = READAHEAD_MAX_SECTORS;
+    if (!size)
+        return;
+    // Use a smaller window if high memory is short
+    for (;;) {
+        bc->ra_buf = malloc_high(size * DISK_SECTOR_SIZE);
+        if (bc->ra_buf)
+            break;
+        size /= 2;
+        if (size < READAHEAD_MIN_SECTORS) {
+            warn_noalloc();
+            return;
+        }
+    }
+    bc->ra_size = size;
+    dprintf(1, "Disk read-ahead: %d sectors\n", size);
+}
+
+// Allocate the cache once all drivers have made their allocations.
+void
+block_prepboot(void)
+{
+    if (!CONFIG_BLOCK_CACHE)
+        return;
+    struct bcache_s *bc = malloc_high(sizeof(*bc));
+    if (!bc) {
+        warn_noalloc();
+        return;
+    }
+    memset(bc, 0, sizeof(*bc));
+    bcache_setup_sectors(bc);
+    bcache_setup_readahead(bc);
+    if (!bc->count && !bc->ra_size) {
+        free(bc);
+        return;
+    }
+    BlockCache = bc;
+}
+
+static struct hlist_head *
+bcache_bucket(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba)
+{
+    return &bc->buckets[((u32)lba ^ ((u32)drive_fl >> 4)) & bc->bucketmask];
+}
+
+static struct bcache_entry_s *
+bcache_lookup(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba)
+{
+    struct bcache_entry_s *e;
+    hlist_for_each_entry(e, bcache_bucket(bc, drive_fl, lba), node) {
+        if (e->drive_fl == drive_fl && e->lba == lba)
+            return e;
+    }
+    return NULL;
+}
+
+static void
+bcache_drop(struct bcache_entry_s *e)
+{
+    hlist_del(&e->node);
+    e->drive_fl = NULL;
+    e->lastuse = 0;
+}
+
+// Remove cached sectors that a write or format may have changed.
+static void
+bcache_invalidate(struct bcache_s *bc, struct disk_op_s *op)
+{
+    if (bc->ra_drive_fl == op->drive_fl) {
+        bc->ra_drive_fl = NULL;
+        bc->ra_count = 0;
+    }
+    if (!bc->count)
+        return;
+    if (op->command != CMD_WRITE) {
+        u32 i;
+        for (i = 0; i < bc->count; i++)
+            if (bc->entries[i].drive_fl == op->drive_fl)
+                bcache_drop(&bc->entries[i]);
+        return;
+    }
+    u32 i;
+    for (i = 0; i < op->count; i++) {
+        struct bcache_entry_s *e = bcache_lookup(bc, op->drive_fl, op->lba + i);
+        if (e)
+            bcache_drop(e);
+    }
+}
+
+// Add a sector to the cache, replacing the least recently used entry.
+static void
+bcache_insert(struct bcache_s *bc, struct drive_s *drive_fl, u64 lba
+              , void *data)
+{
+    struct bcache_entry_s *e = bcache_lookup(bc, drive_fl, lba);
+    if (!e) {
+        struct bcache_entry_s *victim = &bc->entries[0];
+        u32 i;
+        for (i = 1; i < bc->count && victim->lastuse; i++)
+            if (bc->entries[i].lastuse < victim->lastuse)
+                victim = &bc->entries[i];
+        e = victim;
+        if (e->drive_fl)
+            bcache_drop(e);
+        e->drive_fl = drive_fl;
+        e->lba = lba;
+        hlist_add_head(&e->node, bcache_bucket(bc, drive_fl, lba));
+    }
+    e->lastuse = ++bc->clock;
+    memcpy(e->data, data, DISK_SECTOR_SIZE);
+}
+
+// Check if a drive is handled by a driver that only runs in 16bit mode.
+static int
+block_is_16bit_only(struct drive_s *drive_fl)
+{
+    switch (GET_FLATPTR(drive_fl->type)) {
+    case DTYPE_FLOPPY:
+    case DTYPE_ATA:
+    case DTYPE_RAMDISK:
+    case DTYPE_CDEMU:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Check if a drive is handled by a driver that only runs in 32bit mode.
+static int
+block_is_32bit_only(struct drive_s *drive_fl)
+{
+    switch (GET_FLATPTR(drive_fl->type)) {
+    case DTYPE_VIRTIO_BLK:
+    case DTYPE_AHCI:
+    case DTYPE_AHCI_ATAPI:
+    case DTYPE_SDCARD:
+    case DTYPE_USB_32:
+    case DTYPE_UAS_32:
+    case DTYPE_VIRTIO_SCSI:
+    case DTYPE_PVSCSI:
+    case DTYPE_NVME:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Check if requests to a drive may be routed through the sector cache.
+static int
+bcache_usable(struct drive_s *drive_fl)
+{
+    if (!CONFIG_BLOCK_CACHE || !GET_GLOBAL(BlockCache))
+        return 0;
+    // The cache lives in high memory and is only reachable from 32bit
+    // mode, so drivers that only run in 16bit mode can't use it.
+    if (block_is_16bit_only(drive_fl))
+        return 0;
+    return GET_FLATPTR(drive_fl->blksize) == DISK_SECTOR_SIZE;
+}
+
+
 /****************************************************************
  * Disk driver dispatch
  ****************************************************************/
@@ -615,6 +856,178 @@ process_op_16(struct disk_op_s *op)
     }
 }
 
+// Largest request (in blocks) that is passed to a driver at once.
+static u32
+block_max_count(struct drive_s *drive_fl)
+{
+    switch (drive_fl->type) {
+    case DTYPE_AHCI:
+    case DTYPE_NVME:
+    case DTYPE_VIRTIO_BLK:
+        // These drivers handle requests of any size.
+        return 0xffff;
+    case DTYPE_USB:
+    case DTYPE_USB_32:
+        return USB_MSC_MAX_XFER / drive_fl->blksize;
+    default:
+        return 64*1024 / drive_fl->blksize;
+    }
+}
+
+// Serve a read from the read-ahead window, refilling it for sequential
+// streams.  Returns -1 if the read should go elsewhere.
+static int
+readahead_read(struct bcache_s *bc, struct disk_op_s *op)
+{
+    if (!bc->ra_size)
+        return -1;
+    u64 lba = op->lba;
+    if (bc->ra_drive_fl == op->drive_fl && lba == bc->ra_next) {
+        bc->ra_streak++;
+    } else {
+        if (bc->ra_drive_fl != op->drive_fl)
+            // The window holds another drive's sectors
+            bc->ra_count = 0;
+        bc->ra_drive_fl = op->drive_fl;
+        bc->ra_streak = 0;
+    }
+    bc->ra_next = lba + op->count;
+
+    if (lba < bc->ra_lba || lba + op->count > bc->ra_lba + bc->ra_count) {
+        // Only refill for the second and later reads of a stream, and
+        // only if the window holds more than this request.
+        if (!bc->ra_streak || op->count * 2 > bc->ra_size)
+            return -1;
+        u64 sectors = op->drive_fl->sectors;
+        if (sectors && lba >= sectors)
+            return -1;
+        u32 count = bc->ra_size;
+        if (sectors && lba + count > sectors)
+            count = sectors - lba;
+        if (count < op->count)
+            return -1;
+        bc->ra_count = 0;
+        u32 max = block_max_count(op->drive_fl), done = 0;
+        while (done < count) {
+            struct disk_op_s dop;
+            memset(&dop, 0, sizeof(dop));
+            dop.drive_fl = op->drive_fl;
+            dop.command = CMD_READ;
+            dop.lba = lba + done;
+            dop.count = count - done > max ? max : count - done;
+            dop.buf_fl = bc->ra_buf + done * DISK_SECTOR_SIZE;
+            int ret = process_op_32(&dop);
+            if (ret)
+                return -1;
+            done += dop.count;
+        }
+        bc->ra_lba = lba;
+        bc->ra_count = count;
+    } else {
+        bc->ra_hits++;
+    }
+    memcpy(op->buf_fl, bc->ra_buf + (lba - bc->ra_lba) * DISK_SECTOR_SIZE
+           , op->count * DISK_SECTOR_SIZE);
+    return DISK_RET_SUCCESS;
+}
+
+// Serve a small read from the sector cache, or read it and add it there.
+static int
+bcache_read(struct bcache_s *bc, struct disk_op_s *op)
+{
+    if (!bc->count || op->count > BCACHE_MAX_READ)
+        return process_op_32(op);
+
+    struct bcache_entry_s *found[BCACHE_MAX_READ];
+    u32 i;
+    for (i = 0; i < op->count; i++) {
+        found[i] = bcache_lookup(bc, op->drive_fl, op->lba + i);
+        if (!found[i])
+            break;
+    }
+    if (i == op->count) {
+        for (i = 0; i < op->count; i++) {
+            found[i]->lastuse = ++bc->clock;
+            memcpy(op->buf_fl + i * DISK_SECTOR_SIZE, found[i]->data
+                   , DISK_SECTOR_SIZE);
+        }
+        bc->hits++;
+        return DISK_RET_SUCCESS;
+    }
+    bc->misses++;
+    int ret = process_op_32(op);
+    if (!ret)
+        for (i = 0; i < op->count; i++)
+            bcache_insert(bc, op->drive_fl, op->lba + i
+                          , op->buf_fl + i * DISK_SECTOR_SIZE);
+    return ret;
+}
+
+// Command dispatch through the disk sector cache
+int VISIBLE32FLAT
+process_op_cached(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    if (!bcache_usable(op->drive_fl))
+        return process_op_32(op);
+    struct bcache_s *bc = BlockCache;
+    switch (op->command) {
+    case CMD_READ:
+        break;
+    case CMD_WRITE:
+    case CMD_FORMAT:
+    case CMD_SCSI:
+        bcache_invalidate(bc, op);
+        // Fall through
+    default:
+        return process_op_32(op);
+    }
+
+    int ret = readahead_read(bc, op);
+    if (ret < 0)
+        ret = bcache_read(bc, op);
+    if (!((bc->hits + bc->misses + bc->ra_hits) % 256))
+        dprintf(3, "Disk sector cache: %d hits, %d misses, %d read-ahead hits\n"
+                , bc->hits, bc->misses, bc->ra_hits);
+    return ret;
+}
+
+// Command dispatch for requests run in 32bit mode - requests to 32bit
+// only drivers, buffers above 1MiB, and transfers over 64KiB.  These go
+// through the sector cache.
+int VISIBLE32FLAT
+process_op_flat(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    u32 max = block_max_count(op->drive_fl);
+    if (op->count <= max || (op->command != CMD_READ
+                             && op->command != CMD_WRITE
+                             && op->command != CMD_VERIFY))
+        return process_op_cached(op);
+
+    // Split the request into pieces the driver accepts.
+    struct disk_op_s dop = *op;
+    u32 blksize = op->drive_fl->blksize, done = 0;
+    int ret = DISK_RET_SUCCESS;
+    while (done < op->count) {
+        u32 count = op->count - done;
+        if (count > max)
+            count = max;
+        dop.lba = op->lba + done;
+        dop.buf_fl = op->buf_fl + done * blksize;
+        dop.count = count;
+        ret = process_op_cached(&dop);
+        if (ret) {
+            if (dop.count != count)
+                done += dop.count;
+            break;
+        }
+        done += count;
+    }
+    op->count = done;
+    return ret;
+}
+
 // Execute a disk_op_s request.
 int
 process_op(struct disk_op_s *op)
@@ -624,14 +1037,36 @@ process_op(struct disk_op_s *op)
             , op->count, op->command);
 
     int ret, origcount = op->count;
-    if (origcount * GET_FLATPTR(op->drive_fl->blksize) > 64*1024) {
-        op->count = 0;
-        return DISK_RET_EBOUNDARY;
-    }
-    if (MODESEGMENT)
-        ret = process_op_16(op);
-    else
-        ret = process_op_32(op);
+    u32 bytes = origcount * GET_FLATPTR(op->drive_fl->blksize);
+    // Buffers above 1MiB can only be reached from 32bit mode.
+    int needflat = (bytes > 64*1024
+                    || ((op->command == CMD_READ || op->command == CMD_WRITE)
+                        && (u32)op->buf_fl + bytes > 0x100000));
+    if (block_is_16bit_only(op->drive_fl)) {
+        if (needflat) {
+            op->count = 0;
+            return DISK_RET_EBOUNDARY;
+        }
+        if (MODESEGMENT)
+            ret = process_op_16(op);
+        else
+            ret = process_op_32(op);
+    } else if (MODESEGMENT) {
+        // Only switch to 32bit mode (and thus the sector cache) when the
+        // request or driver requires it anyway - the switch is costly,
+        // and isn't possible at all when running under vm86.
+        ret = -1;
+        if (needflat || block_is_32bit_only(op->drive_fl))
+            ret = call32(process_op_flat, MAKE_FLATPTR(GET_SEG(SS), op), -1);
+        if (ret < 0) {
+            if (needflat) {
+                op->count = 0;
+                return DISK_RET_EBOUNDARY;
+            }
+            ret = process_op_16(op);
+        }
+    } else
+        ret = process_op_flat(op);
     if (ret && op->count == origcount)
         // If the count hasn't changed on error, assume no data transferred.
         op->count = 0;
@@ -51,6 +51,7 @@ struct drive_s {
     struct chs_s lchs;  // Logical CHS
     u64 sectors;        // Total sectors count
     u32 cntl_id;        // Unique id for a given driver type.
+    u32 unit_id;        // Position on the controller (eg, scsi target/lun)
     u8 removable;       // Is media removable (currently unused)
 
     // Info for EDD calls
@@ -115,6 +116,7 @@ void map_cd_drive(struct drive_s *drive);
 struct int13dpt_s;
 int fill_edd(struct segoff_s edd, struct drive_s *drive_fl);
 void block_setup(void);
+void block_prepboot(void);
 int default_process_op(struct disk_op_s *op);
 int process_op(struct disk_op_s *op);
 int create_bounce_buf(void);
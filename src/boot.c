@@ -17,6 +17,7 @@
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // romfile_loadint
+#include "stacks.h" // run_thread
 #include "std/disk.h" // struct mbr_s
 #include "string.h" // memset
 #include "util.h" // irqtimer_calc
@@ -242,8 +243,60 @@ int boot_lchs_find_ata_device(struct pci_device *pci, int chanid, int slave,
  * Boot priority ordering
  ****************************************************************/
 
-static char **Bootorder VARVERIFY32INIT;
-static int BootorderCount;
+// The bootorder file is indexed as a tree of its '/' separated path
+// components.  Nodes are also hashed on their parent and unit address
+// (the text after the '@'), so a lookup costs about one hash probe per
+// component of the searched path instead of a scan of every line.
+//
+// Unlike globbing each whole line, a component's unit address is always
+// taken from its first '@', so a '*' in the device name of a search can
+// no longer skip over an '@' to match a later one (for example, "*b@1"
+// no longer matches "a@b@1").  Search components with a '*' in the unit
+// address still glob every child.
+struct bootorder_node_s {
+    const char *name, *unit;
+    struct bootorder_node_s *parent, *child, *sibling, *hnext;
+    int prio; // First bootorder line at or below this node
+};
+
+static struct bootorder_node_s *BootorderNodes VARVERIFY32INIT;
+static struct bootorder_node_s **BootorderHash VARVERIFY32INIT;
+static int BootorderCount, BootorderNodeCount, BootorderHashSize;
+
+#define BOOTORDER_MAX_DEPTH 32
+
+static u32
+bootorder_hash(struct bootorder_node_s *parent, const char *unit)
+{
+    u32 hash = (u32)parent;
+    while (*unit)
+        hash = hash * 31 + *unit++;
+    return hash & (BootorderHashSize - 1);
+}
+
+// Find (or add) the child of 'parent' with the given component name.
+static struct bootorder_node_s *
+bootorder_add_child(struct bootorder_node_s *parent, char *name, int prio)
+{
+    char *unit = strchr(name, '@');
+    unit = unit ? unit + 1 : name + strlen(name);
+    u32 hash = bootorder_hash(parent, unit);
+    struct bootorder_node_s *node;
+    for (node = BootorderHash[hash]; node; node = node->hnext)
+        if (node->parent == parent && strcmp(node->name, name) == 0)
+            return node;
+
+    node = &BootorderNodes[BootorderNodeCount++];
+    node->name = name;
+    node->unit = unit;
+    node->parent = parent;
+    node->prio = prio;
+    node->sibling = parent->child;
+    parent->child = node;
+    node->hnext = BootorderHash[hash];
+    BootorderHash[hash] = node;
+    return node;
+}
 
 static void
 loadBootOrder(void)
@@ -255,32 +308,86 @@ loadBootOrder(void)
     if (!f)
         return;
 
-    int i = 0;
-    BootorderCount = 1;
+    int i = 0, count = 1, nodes = 1;
     while (f[i]) {
         if (f[i] == '\n')
-            BootorderCount++;
+            count++;
+        if (f[i] == '\n' || f[i] == '/')
+            nodes++;
         i++;
     }
-    Bootorder = malloc_tmphigh(BootorderCount*sizeof(char*));
-    if (!Bootorder) {
+    BootorderHashSize = 1;
+    while (BootorderHashSize < nodes)
+        BootorderHashSize <<= 1;
+    BootorderNodes = malloc_tmphigh((nodes + 1) * sizeof(BootorderNodes[0]));
+    BootorderHash = malloc_tmphigh(BootorderHashSize * sizeof(BootorderHash[0]));
+    if (!BootorderNodes || !BootorderHash) {
         warn_noalloc();
+        free(BootorderNodes);
+        free(BootorderHash);
         free(f);
-        BootorderCount = 0;
         return;
     }
+    memset(BootorderNodes, 0, (nodes + 1) * sizeof(BootorderNodes[0]));
+    memset(BootorderHash, 0, BootorderHashSize * sizeof(BootorderHash[0]));
+    BootorderNodeCount = 1;
+    BootorderNodes[0].prio = -1;
 
     dprintf(1, "boot order:\n");
-    i = 0;
-    do {
-        Bootorder[i] = f;
+    for (i = 1; i <= count; i++) {
+        char *line = f;
         f = strchr(f, '\n');
         if (f)
             *(f++) = '\0';
-        Bootorder[i] = nullTrailingSpace(Bootorder[i]);
-        dprintf(1, "%d: %s\n", i+1, Bootorder[i]);
-        i++;
-    } while (f);
+        line = nullTrailingSpace(line);
+        dprintf(1, "%d: %s\n", i, line);
+
+        struct bootorder_node_s *node = BootorderNodes;
+        for (;;) {
+            char *sep = strchr(line, '/');
+            if (sep)
+                *sep = '\0';
+            node = bootorder_add_child(node, line, i);
+            if (!sep)
+                break;
+            line = sep + 1;
+        }
+    }
+    BootorderCount = count;
+}
+
+// Find the first bootorder line below 'parent' matching the remaining
+// glob path components.
+static int
+bootorder_find(struct bootorder_node_s *parent, char **comps, int count)
+{
+    if (!count)
+        return parent->prio;
+    const char *glob = comps[0], *unit = strchr(glob, '@');
+    struct bootorder_node_s *node;
+    int best = -1;
+    if (unit && !strchr(unit, '*')) {
+        // Only siblings with the same unit address can match.
+        unit++;
+        node = BootorderHash[bootorder_hash(parent, unit)];
+        for (; node; node = node->hnext) {
+            if (node->parent != parent || strcmp(node->unit, unit) != 0
+                || !glob_prefix(glob, node->name))
+                continue;
+            int prio = bootorder_find(node, comps + 1, count - 1);
+            if (prio >= 0 && (best < 0 || prio < best))
+                best = prio;
+        }
+        return best;
+    }
+    for (node = parent->child; node; node = node->sibling) {
+        if (!glob_prefix(glob, node->name))
+            continue;
+        int prio = bootorder_find(node, comps + 1, count - 1);
+        if (prio >= 0 && (best < 0 || prio < best))
+            best = prio;
+    }
+    return best;
 }
 
 // Search the bootorder list for the given glob pattern.
@@ -288,11 +395,21 @@ static int
 find_prio(const char *glob)
 {
     dprintf(1, "Searching bootorder for: %s\n", glob);
-    int i;
-    for (i = 0; i < BootorderCount; i++)
-        if (glob_prefix(glob, Bootorder[i]))
-            return i+1;
-    return -1;
+    if (!BootorderCount)
+        return -1;
+    char buf[256], *comps[BOOTORDER_MAX_DEPTH];
+    int count = 0;
+    char *p = strtcpy(buf, glob, sizeof(buf));
+    for (;;) {
+        if (count >= ARRAY_SIZE(comps))
+            return -1;
+        comps[count++] = p;
+        p = strchr(p, '/');
+        if (!p)
+            break;
+        *(p++) = '\0';
+    }
+    return bootorder_find(BootorderNodes, comps, count);
 }
 
 u8 is_bootprio_strict(void)
@@ -543,7 +660,9 @@ bootentry_add(int type, int prio, u32 data, const char *desc)
         if (be->type <= IPL_TYPE_CDROM
             && (be->drive->type < pos->drive->type
                 || (be->drive->type == pos->drive->type
-                    && be->drive->cntl_id < pos->drive->cntl_id)))
+                    && (be->drive->cntl_id < pos->drive->cntl_id
+                        || (be->drive->cntl_id == pos->drive->cntl_id
+                            && be->drive->unit_id < pos->drive->unit_id)))))
             break;
     }
     hlist_add(&be->node, pprev);
@@ -612,6 +731,103 @@ boot_add_cbfs(void *data, const char *desc, int prio)
 }
 
 
+/****************************************************************
+ * Boot order driven controller probing
+ ****************************************************************/
+
+struct bootprobe_s {
+    void (*func)(void *);
+    struct pci_device *pci;
+    int priority;
+    struct hlist_node node;
+};
+static struct hlist_head BootProbeList VARVERIFY32INIT;
+
+// Start initialization of a storage controller.  When probing in boot
+// order, the controller is queued (sorted by its first bootorder entry)
+// and started from boot_probe_setup() instead.
+void
+boot_probe_pci(void (*func)(void *), struct pci_device *pci)
+{
+    if (!CONFIG_BOOTORDER_PROBE || !BootorderCount) {
+        run_thread(func, pci);
+        return;
+    }
+    struct bootprobe_s *bp = malloc_tmp(sizeof(*bp));
+    if (!bp) {
+        warn_noalloc();
+        run_thread(func, pci);
+        return;
+    }
+    bp->func = func;
+    bp->pci = pci;
+    bp->priority = defPrio(bootprio_find_pci_device(pci), DEFAULT_PRIO);
+
+    // Add entry in sorted order (keeping pci order for equal priorities).
+    struct hlist_node **pprev;
+    struct bootprobe_s *pos;
+    hlist_for_each_entry_pprev(pos, pprev, &BootProbeList, node) {
+        if (bp->priority < pos->priority)
+            break;
+    }
+    hlist_add(&bp->node, pprev);
+}
+
+// Check if a device listed in the bootorder file at or before 'prio'
+// has been registered.
+static int
+boot_probe_found(int prio)
+{
+    if (hlist_empty(&BootList))
+        return 0;
+    struct bootentry_s *be = container_of(
+        BootList.first, struct bootentry_s, node);
+    return be->priority <= BootorderCount && be->priority <= prio;
+}
+
+static void
+boot_probe_thread(void *data)
+{
+    // Probe the controllers holding bootorder entries one at a time
+    // until one of them provides the first bootable device.
+    struct bootprobe_s *pos;
+    struct hlist_node *n;
+    hlist_for_each_entry_safe(pos, n, &BootProbeList, node) {
+        if (boot_probe_found(pos->priority))
+            break;
+        if (pos->priority == DEFAULT_PRIO) {
+            // Nothing found yet - start everything else in parallel.
+            run_thread(pos->func, pos->pci);
+        } else {
+            dprintf(1, "Probing %pP (bootorder %d)\n", pos->pci, pos->priority);
+            pos->func(pos->pci);
+        }
+        hlist_del(&pos->node);
+        free(pos);
+    }
+    // With a strict boot order the remaining controllers are never
+    // needed.  Otherwise they are still probed (in parallel, while the
+    // boot menu waits) so that boot can fall back to their devices.
+    int strict = is_bootprio_strict();
+    hlist_for_each_entry_safe(pos, n, &BootProbeList, node) {
+        if (strict)
+            dprintf(1, "Skipping probe of %pP\n", pos->pci);
+        else
+            run_thread(pos->func, pos->pci);
+        hlist_del(&pos->node);
+        free(pos);
+    }
+}
+
+// Start probing of the controllers queued by boot_probe_pci().
+void
+boot_probe_setup(void)
+{
+    if (!hlist_empty(&BootProbeList))
+        run_thread(boot_probe_thread, NULL);
+}
+
+
 /****************************************************************
  * Keyboard calls
  ****************************************************************/
@@ -692,7 +908,8 @@ interactive_bootmenu(void)
 
     // skip menu if only one boot device and no TPM
     if (show_boot_menu == 2 && !tpm_can_show_menu()
-        && !hlist_empty(&BootList) && !BootList.first->next) {
+        && !hlist_empty(&BootList) && !BootList.first->next
+        && hlist_empty(&BootProbeList)) {
         dprintf(1, "Only one boot device present. Skip boot menu.\n");
         printf("\n");
         return;
@@ -10,7 +10,7 @@
 #include "farptr.h" // FLATPTR_TO_SEG
 #include "malloc.h" // free
 #include "output.h" // dprintf
-#include "romfile.h" // romfile_loadfile
+#include "romfile.h" // romfile_copy_start
 #include "stacks.h" // call16_int
 #include "std/vbe.h" // struct vbe_info
 #include "string.h" // memset
@@ -102,16 +102,30 @@ enable_bootsplash(void)
     /* splash picture can be bmp or jpeg file */
     dprintf(3, "Checking for bootsplash\n");
     u8 type = 0; /* 0 means jpg, 1 means bmp, default is 0=jpg */
-    int filesize;
-    u8 *filedata = romfile_loadfile("bootsplash.jpg", &filesize);
-    if (!filedata) {
-        filedata = romfile_loadfile("bootsplash.bmp", &filesize);
-        if (!filedata)
+    struct romfile_s *file = romfile_find("bootsplash.jpg");
+    if (!file || !file->size) {
+        file = romfile_find("bootsplash.bmp");
+        if (!file || !file->size)
             return;
         type = 1;
     }
+    int filesize = file->size;
+    u8 *filedata = malloc_tmphigh(filesize + 1);
+    if (!filedata) {
+        warn_noalloc();
+        return;
+    }
+    filedata[filesize] = '\0';
     dprintf(3, "start showing bootsplash\n");
 
+    // Load the image in the background while probing the video card.
+    struct romfile_req_s req;
+    memset(&req, 0, sizeof(req));
+    req.file = file;
+    req.dst = filedata;
+    req.maxlen = filesize;
+    romfile_copy_start(&req);
+
     u8 *picture = NULL; /* data buff used to be flushed to the video buf */
     struct jpeg_decdata *jpeg = NULL;
     struct bmp_decdata *bmp = NULL;
@@ -145,6 +159,8 @@ enable_bootsplash(void)
 
     int ret, width, height;
     int bpp_require = 0;
+    if (romfile_copy_wait(&req) != filesize)
+        goto done;
     if (type == 0) {
         jpeg = jpeg_alloc();
         if (!jpeg) {
@@ -236,6 +252,7 @@ enable_bootsplash(void)
     BootsplashActive = 1;
 
 done:
+    romfile_copy_wait(&req);
     free(filedata);
     free(picture);
     free(vesa_info);
@@ -26,6 +26,34 @@ struct eltorito_s CDEmu VARLOW = { .size=sizeof(CDEmu) };
 struct drive_s *emulated_drive_gf VARLOW;
 struct drive_s *cdemu_drive_gf VARFSEG;
 
+// The most recently read cdrom block, so that a run of 512 byte reads
+// within a block only reads that block once.  The buffer is allocated
+// before boot (the malloc zones are closed by the time cdrom_boot() runs)
+// from ZoneLow, so it holds just the one block.
+#define CDEMU_NO_BLOCK ((u32)-1)
+u8 *cdemu_cache_fl VARFSEG;
+u32 CDEmuCacheLba VARLOW = CDEMU_NO_BLOCK;
+
+// Find the block at dop->lba in the cache, reading it in if necessary.
+static int
+cdemu_read_block(struct disk_op_s *dop, u8 **buf_fl)
+{
+    u8 *cache_fl = GET_GLOBAL(cdemu_cache_fl);
+    u32 lba = dop->lba;
+    *buf_fl = cache_fl;
+    if (GET_LOW(CDEmuCacheLba) == lba)
+        return DISK_RET_SUCCESS;
+
+    SET_LOW(CDEmuCacheLba, CDEMU_NO_BLOCK);
+    dop->count = 1;
+    dop->buf_fl = cache_fl;
+    int ret = process_op(dop);
+    if (ret)
+        return ret;
+    SET_LOW(CDEmuCacheLba, lba);
+    return DISK_RET_SUCCESS;
+}
+
 static int
 cdemu_read(struct disk_op_s *op)
 {
@@ -37,13 +65,11 @@ cdemu_read(struct disk_op_s *op)
 
     int count = op->count;
     op->count = 0;
-    u8 *cdbuf_fl = GET_GLOBAL(bounce_buf_fl);
+    u8 *cdbuf_fl;
 
     if (op->lba & 3) {
         // Partial read of first block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        int ret = cdemu_read_block(&dop, &cdbuf_fl);
         if (ret)
             return ret;
         u8 thiscount = 4 - (op->lba & 3);
@@ -72,9 +98,7 @@ cdemu_read(struct disk_op_s *op)
 
     if (count) {
         // Partial read on last block.
-        dop.count = 1;
-        dop.buf_fl = cdbuf_fl;
-        int ret = process_op(&dop);
+        int ret = cdemu_read_block(&dop, &cdbuf_fl);
         if (ret)
             return ret;
         u8 thiscount = count;
@@ -109,14 +133,16 @@ cdrom_prepboot(void)
         return;
     if (!CDCount)
         return;
-    if (create_bounce_buf() < 0)
-        return;
 
+    u8 *cache = malloc_low(CDROM_SECTOR_SIZE);
     struct drive_s *drive = malloc_fseg(sizeof(*drive));
-    if (!drive) {
+    if (!cache || !drive) {
         warn_noalloc();
+        free(cache);
+        free(drive);
         return;
     }
+    cdemu_cache_fl = cache;
     cdemu_drive_gf = drive;
     memset(drive, 0, sizeof(*drive));
     drive->type = DTYPE_CDEMU;
@@ -189,6 +215,7 @@ cdrom_boot(struct drive_s *drive)
 
     // Fill in el-torito cdrom emulation fields.
     emulated_drive_gf = drive;
+    CDEmuCacheLba = CDEMU_NO_BLOCK;
     u8 media = buffer[0x21];
 
     u16 boot_segment = *(u16*)&buffer[0x22];
@@ -296,7 +323,7 @@ cdrom_media_info(struct drive_s *drive)
     dop.lba = 0x11;
     dop.count = 1;
     dop.buf_fl = buffer;
-    ret = process_op(&dop);
+    ret = scsi_setup_op(&dop);
     if (ret)
         return NULL;
 
@@ -311,7 +338,7 @@ cdrom_media_info(struct drive_s *drive)
     dop.lba = 0x10;
     dop.count = 1;
     dop.buf_fl = buffer;
-    ret = process_op(&dop);
+    ret = scsi_setup_op(&dop);
     if (ret)
         return NULL;
 
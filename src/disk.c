@@ -174,17 +174,57 @@ extended_access(struct bregs *regs, struct drive_s *drive_fl, u16 command)
         return;
     }
 
-    dop.buf_fl = SEGOFF_TO_FLATPTR(GET_FARVAR(regs->ds, param_far->data));
-    dop.count = GET_FARVAR(regs->ds, param_far->count);
-    if (! dop.count) {
+    // EDD 3.0 packets may give a 64bit flat buffer address and a 32bit
+    // block count instead.
+    u8 size = GET_FARVAR(regs->ds, param_far->size);
+    struct segoff_s data = GET_FARVAR(regs->ds, param_far->data);
+    u32 count = GET_FARVAR(regs->ds, param_far->count);
+    int flatcount = 0;
+    if (count == 0xff && size >= 0x20) {
+        count = GET_FARVAR(regs->ds, param_far->count_flat);
+        flatcount = 1;
+    }
+    if (! count) {
         // Nothing to do.
         disk_ret(regs, DISK_RET_SUCCESS);
         return;
     }
+    u32 blksize = GET_FLATPTR(drive_fl->blksize);
+    if (data.segoff == 0xffffffff && size >= 0x18) {
+        u64 addr = GET_FARVAR(regs->ds, param_far->data_flat);
+        if (addr + (u64)count * blksize > 0x100000000ULL) {
+            warn_invalid(regs);
+            disk_ret(regs, DISK_RET_EPARAM);
+            return;
+        }
+        dop.buf_fl = (void*)(u32)addr;
+    } else {
+        dop.buf_fl = SEGOFF_TO_FLATPTR(data);
+    }
 
-    int status = send_disk_op(&dop);
+    // A disk_op_s holds at most 0xffff blocks - issue larger transfers
+    // in several requests.
+    void *buf_fl = dop.buf_fl;
+    u64 lba = dop.lba;
+    u32 done = 0;
+    int status;
+    for (;;) {
+        u32 chunk = count - done;
+        if (chunk > 0x8000)
+            chunk = 0x8000;
+        dop.lba = lba + done;
+        dop.buf_fl = buf_fl + done * blksize;
+        dop.count = chunk;
+        status = send_disk_op(&dop);
+        done += dop.count;
+        if (status || done >= count)
+            break;
+    }
 
-    SET_FARVAR(regs->ds, param_far->count, dop.count);
+    if (flatcount)
+        SET_FARVAR(regs->ds, param_far->count_flat, done);
+    else
+        SET_FARVAR(regs->ds, param_far->count, done);
 
     disk_ret(regs, status);
 }
@@ -38,6 +38,8 @@ int PlatformRunningOn VARFSEG;
 int cfg_enabled = 0;
 // cfg_dma enabled
 int cfg_dma_enabled = 0;
+// Asynchronous DMA request in progress (if any)
+static QemuCfgDmaAccess *cfg_dma_pending;
 
 inline int qemu_cfg_enabled(void)
 {
@@ -276,9 +278,21 @@ qemu_platform_setup(void)
 #define QEMU_CFG_IRQ0_OVERRIDE          (QEMU_CFG_ARCH_LOCAL + 2)
 #define QEMU_CFG_E820_TABLE             (QEMU_CFG_ARCH_LOCAL + 3)
 
+// The fw_cfg device handles one request at a time - wait for any
+// asynchronous DMA request to complete before accessing it.
+static void
+qemu_cfg_dma_idle(void)
+{
+    while (cfg_dma_pending && (be32_to_cpu(cfg_dma_pending->control)
+                               & ~QEMU_CFG_DMA_CTL_ERROR))
+        yield();
+    cfg_dma_pending = NULL;
+}
+
 static void
 qemu_cfg_select(u16 f)
 {
+    qemu_cfg_dma_idle();
     outw(f, PORT_QEMU_CFG_CTL);
 }
 
@@ -287,6 +301,8 @@ qemu_cfg_dma_transfer(void *address, u32 length, u32 control)
 {
     QemuCfgDmaAccess access;
 
+    qemu_cfg_dma_idle();
+
     access.address = cpu_to_be64((u64)(u32)address);
     access.length = cpu_to_be32(length);
     access.control = cpu_to_be32(control);
@@ -391,6 +407,58 @@ qemu_cfg_read_file(struct romfile_s *file, void *dst, u32 maxlen)
     return file->size;
 }
 
+// Start reading a file with a single DMA request that completes in the
+// background.  Returns -1 (without starting anything) if the file can't
+// be read that way.  The request must be completed with
+// qemu_cfg_dma_finish() (or polled until qemu_cfg_dma_poll() returns
+// true) before the handle is released.
+int
+qemu_cfg_read_start(struct qemu_cfg_dma_s *dma, struct romfile_s *file
+                    , void *dst, u32 maxlen)
+{
+    if (!qemu_cfg_dma_enabled() || file->copy != qemu_cfg_read_file)
+        return -1;
+    struct qemu_romfile_s *qfile;
+    qfile = container_of(file, struct qemu_romfile_s, file);
+    if (qfile->skip || !file->size || file->size > maxlen)
+        return -1;
+
+    qemu_cfg_dma_idle();
+    dma->size = file->size;
+    dma->access.address = cpu_to_be64((u64)(u32)dst);
+    dma->access.length = cpu_to_be32(file->size);
+    dma->access.control = cpu_to_be32((qfile->select << 16)
+                                      | QEMU_CFG_DMA_CTL_SELECT
+                                      | QEMU_CFG_DMA_CTL_READ);
+    cfg_dma_pending = &dma->access;
+    barrier();
+    outl(cpu_to_be32((u32)&dma->access), PORT_QEMU_CFG_DMA_ADDR_LOW);
+    return 0;
+}
+
+// Check if a request started with qemu_cfg_read_start() has completed.
+int
+qemu_cfg_dma_poll(struct qemu_cfg_dma_s *dma)
+{
+    if (be32_to_cpu(dma->access.control) & ~QEMU_CFG_DMA_CTL_ERROR)
+        return 0;
+    if (cfg_dma_pending == &dma->access)
+        cfg_dma_pending = NULL;
+    return 1;
+}
+
+// Wait for a request started with qemu_cfg_read_start().  Returns the
+// number of bytes read or -1 on error.
+int
+qemu_cfg_dma_finish(struct qemu_cfg_dma_s *dma)
+{
+    while (!qemu_cfg_dma_poll(dma))
+        yield();
+    if (be32_to_cpu(dma->access.control) & QEMU_CFG_DMA_CTL_ERROR)
+        return -1;
+    return dma->size;
+}
+
 // Bare-bones function for writing a file knowing only its unique
 // identifying key (select)
 int
@@ -634,13 +702,21 @@ void qemu_cfg_init(void)
     u32 count;
     qemu_cfg_read_entry(&count, QEMU_CFG_FILE_DIR, sizeof(count));
     count = be32_to_cpu(count);
+    // Read the whole directory in one transfer if possible.
+    struct QemuCfgFile *dir = malloc_tmp(count * sizeof(*dir));
+    if (dir)
+        qemu_cfg_read(dir, count * sizeof(*dir));
     u32 e;
     for (e = 0; e < count; e++) {
         struct QemuCfgFile qfile;
-        qemu_cfg_read(&qfile, sizeof(qfile));
+        if (dir)
+            qfile = dir[e];
+        else
+            qemu_cfg_read(&qfile, sizeof(qfile));
         qemu_romfile_add(qfile.name, be16_to_cpu(qfile.select)
                          , 0, be32_to_cpu(qfile.size));
     }
+    free(dir);
 
     qemu_cfg_e820();
 
@@ -74,5 +74,14 @@ u16 qemu_get_present_cpus_count(void);
 int qemu_cfg_write_file(void *src, struct romfile_s *file, u32 offset, u32 len);
 int qemu_cfg_write_file_simple(void *src, u16 key, u32 offset, u32 len);
 u16 qemu_get_romfile_key(struct romfile_s *file);
+// An asynchronous fw_cfg file read (see qemu_cfg_read_start())
+struct qemu_cfg_dma_s {
+    QemuCfgDmaAccess access;
+    u32 size;
+};
+int qemu_cfg_read_start(struct qemu_cfg_dma_s *dma, struct romfile_s *file
+                        , void *dst, u32 maxlen);
+int qemu_cfg_dma_poll(struct qemu_cfg_dma_s *dma);
+int qemu_cfg_dma_finish(struct qemu_cfg_dma_s *dma);
 
 #endif
@@ -59,7 +59,6 @@ static void romfile_loader_allocate(struct romfile_loader_entry_s *entry,
     struct zone_s *zone;
     struct romfile_loader_file *file = &files->files[files->nfiles];
     void *data;
-    int ret;
     unsigned alloc_align = le32_to_cpu(entry->alloc.align);
 
     if (alloc_align & (alloc_align - 1))
@@ -87,19 +86,51 @@ static void romfile_loader_allocate(struct romfile_loader_entry_s *entry,
         warn_noalloc();
         return;
     }
-    ret = file->file->copy(file->file, data, file->file->size);
-    if (ret != file->file->size)
-        goto file_err;
+    // The file contents are read by romfile_loader_load().
     file->data = data;
     files->nfiles++;
     return;
 
-file_err:
-    free(data);
 err:
     warn_internalerror();
 }
 
+// Read the contents of all allocated files in one batch.  Files that
+// could not be read are dropped from the list, so later commands can't
+// refer to them.
+static void romfile_loader_load(struct romfile_loader_files *files)
+{
+    int i, count = files->nfiles;
+    if (!count)
+        return;
+    struct romfile_req_s *reqs = malloc_tmp(count * sizeof(reqs[0]));
+    if (!reqs) {
+        warn_noalloc();
+        for (i = 0; i < count; i++)
+            free(files->files[i].data);
+        files->nfiles = 0;
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        struct romfile_loader_file *file = &files->files[i];
+        reqs[i].file = file->file;
+        reqs[i].dst = file->data;
+        reqs[i].maxlen = file->file->size;
+    }
+    romfile_copy_batch(reqs, count);
+    files->nfiles = 0;
+    for (i = 0; i < count; i++) {
+        struct romfile_loader_file *file = &files->files[i];
+        if (reqs[i].ret != file->file->size) {
+            free(file->data);
+            warn_internalerror();
+            continue;
+        }
+        files->files[files->nfiles++] = *file;
+    }
+    free(reqs);
+}
+
 static void romfile_loader_add_pointer(struct romfile_loader_entry_s *entry,
                                        struct romfile_loader_files *files)
 {
@@ -228,12 +259,17 @@ int romfile_loader_execute(const char *name)
     }
     files->nfiles = 0;
 
+    // Allocate all files first, so their contents can be read together.
+    for (offset = 0; offset < size; offset += sizeof(*entry)) {
+        entry = data + offset;
+        if (le32_to_cpu(entry->command) == ROMFILE_LOADER_COMMAND_ALLOCATE)
+            romfile_loader_allocate(entry, files);
+    }
+    romfile_loader_load(files);
+
     for (offset = 0; offset < size; offset += sizeof(*entry)) {
         entry = data + offset;
         switch (le32_to_cpu(entry->command)) {
-                case ROMFILE_LOADER_COMMAND_ALLOCATE:
-                        romfile_loader_allocate(entry, files);
-                        break;
                 case ROMFILE_LOADER_COMMAND_ADD_POINTER:
                         romfile_loader_add_pointer(entry, files);
                         break;
@@ -24,6 +24,22 @@
 #define AHCI_RESET_TIMEOUT     500 // 500 miliseconds
 #define AHCI_LINK_TIMEOUT       10 // 10 miliseconds
 
+// A prd entry describes at most 4MiB; the command table holds the rest.
+#define AHCI_MAX_PRD_BYTES      (4*1024*1024)
+#define AHCI_MAX_PRD            ((AHCI_CMD_TABLE_SIZE                   \
+                                  - sizeof(struct ahci_cmd_s)) / 16)
+#define AHCI_MAX_XFER_SECTORS   (AHCI_MAX_PRD * AHCI_MAX_PRD_BYTES      \
+                                 / DISK_SECTOR_SIZE)
+
+// NCQ splits requests into chunks of at least this many sectors.
+#define AHCI_NCQ_MIN_SECTORS    16
+
+// Ports (by ncq_failbit) that stopped using NCQ after a queued command
+// failed.  The port structs are in the f-segment, which is read-only at
+// runtime.
+u32 AhciNcqFailed VARLOW;
+static u32 AhciNcqPorts;
+
 // prepare sata command fis
 static void sata_prep_simple(struct sata_cmd_fis *fis, u8 command)
 {
@@ -60,6 +76,24 @@ static void sata_prep_readwrite(struct sata_cmd_fis *fis,
     fis->device       = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 }
 
+static void sata_prep_fpdma(struct sata_cmd_fis *fis, u64 lba, u16 count,
+                            u8 tag, int iswrite)
+{
+    memset_fl(fis, 0, sizeof(*fis));
+    fis->command       = (iswrite ? ATA_CMD_WRITE_FPDMA_QUEUED
+                          : ATA_CMD_READ_FPDMA_QUEUED);
+    fis->feature       = count;
+    fis->feature2      = count >> 8;
+    fis->sector_count  = tag << 3;
+    fis->lba_low       = lba;
+    fis->lba_mid       = lba >> 8;
+    fis->lba_high      = lba >> 16;
+    fis->lba_low2      = lba >> 24;
+    fis->lba_mid2      = lba >> 32;
+    fis->lba_high2     = lba >> 40;
+    fis->device        = ATA_CB_DH_LBA;
+}
+
 static void sata_prep_atapi(struct sata_cmd_fis *fis, u16 blocksize)
 {
     memset_fl(fis, 0, sizeof(*fis));
@@ -100,31 +134,96 @@ static void ahci_port_writel(struct ahci_ctrl_s *ctrl, u32 pnr, u32 reg, u32 val
     ahci_ctrl_writel(ctrl, ctrl_reg, val);
 }
 
-// submit ahci command + wait for result
-static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
-                        void *buffer, u32 bsize)
+// command table used by a command slot
+static struct ahci_cmd_s *ahci_slot_cmd(struct ahci_port_s *port, u32 slot)
 {
-    u32 val, status, success, flags, intbits, error;
-    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
-    struct ahci_cmd_s  *cmd  = port_gf->cmd;
-    struct ahci_fis_s  *fis  = port_gf->fis;
+    return (void*)port->cmd + slot * AHCI_CMD_TABLE_SIZE;
+}
+
+// fill in the command header of a slot, its fis is already prepared
+static void ahci_prep_slot(struct ahci_port_s *port_gf, u32 slot, int iswrite,
+                           int isatapi, void *buffer, u32 bsize)
+{
+    struct ahci_cmd_s  *cmd  = ahci_slot_cmd(port_gf, slot);
     struct ahci_list_s *list = port_gf->list;
-    u32 pnr                  = port_gf->pnr;
+    u32 flags, prds = 0;
 
     cmd->fis.reg       = 0x27;
     cmd->fis.pmp_type  = 1 << 7; /* cmd fis */
-    cmd->prdt[0].base  = (u32)buffer;
-    cmd->prdt[0].baseu = 0;
-    cmd->prdt[0].flags = bsize-1;
+    while (bsize && prds < AHCI_MAX_PRD) {
+        u32 len = bsize < AHCI_MAX_PRD_BYTES ? bsize : AHCI_MAX_PRD_BYTES;
+        cmd->prdt[prds].base  = (u32)buffer;
+        cmd->prdt[prds].baseu = 0;
+        cmd->prdt[prds].flags = len-1;
+        buffer += len;
+        bsize -= len;
+        prds++;
+    }
+    if (bsize)
+        warn_internalerror();
 
-    flags = ((1 << 16) | /* one prd entry */
+    flags = ((prds << 16) | /* prd entries */
              (iswrite ? (1 << 6) : 0) |
              (isatapi ? (1 << 5) : 0) |
              (5 << 0)); /* fis length (dwords) */
-    list[0].flags  = flags;
-    list[0].bytes  = 0;
-    list[0].base   = (u32)(cmd);
-    list[0].baseu  = 0;
+    list[slot].flags  = flags;
+    list[slot].bytes  = 0;
+    list[slot].base   = (u32)(cmd);
+    list[slot].baseu  = 0;
+}
+
+// non-queued error recovery (AHCI 1.3 section 6.2.2.1)
+static void ahci_port_recover(struct ahci_ctrl_s *ctrl, u32 pnr, int comreset)
+{
+    u32 val;
+
+    // Clears PxCMD.ST to 0 to reset the PxCI register
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+
+    // waits for PxCMD.CR to clear to 0
+    while (1) {
+        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+        if ((val & PORT_CMD_LIST_ON) == 0)
+            break;
+        yield();
+    }
+
+    // Clears any error bits in PxSERR to enable capturing new errors
+    val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+
+    // Clears status bits in PxIS as appropriate
+    val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+
+    // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
+    // a COMRESET to the device to put it in an idle state
+    val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
+    if (comreset || (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ))) {
+        dprintf(2, "AHCI/%d: issue comreset\n", pnr);
+        val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
+        // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
+        mdelay (1);
+        ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    }
+
+    // Sets PxCMD.ST to 1 to enable issuing new commands
+    val = ahci_port_readl(ctrl, pnr, PORT_CMD);
+    ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+}
+
+// submit ahci command + wait for result
+static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
+                        void *buffer, u32 bsize)
+{
+    u32 status, success, intbits, error;
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    struct ahci_fis_s  *fis  = port_gf->fis;
+    u32 pnr                  = port_gf->pnr;
+
+    ahci_prep_slot(port_gf, 0, iswrite, isatapi, buffer, bsize);
 
     dprintf(8, "AHCI/%d: send cmd ...\n", pnr);
     intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
@@ -168,45 +267,81 @@ static int ahci_command(struct ahci_port_s *port_gf, int iswrite, int isatapi,
     } else {
         dprintf(2, "AHCI/%d: ... finished, status 0x%x, ERROR 0x%x\n", pnr,
                 status, error);
+        ahci_port_recover(ctrl, pnr, 0);
+    }
+    return success ? 0 : -1;
+}
 
-        // non-queued error recovery (AHCI 1.3 section 6.2.2.1)
-        // Clears PxCMD.ST to 0 to reset the PxCI register
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val & ~PORT_CMD_START);
+// native command queuing error recovery (AHCI 1.3 section 6.2.2.2)
+static void ahci_ncq_recover(struct ahci_port_s *port_gf)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr                  = port_gf->pnr;
 
-        // waits for PxCMD.CR to clear to 0
-        while (1) {
-            val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-            if ((val & PORT_CMD_LIST_ON) == 0)
-                break;
-            yield();
-        }
+    // Send later requests down the non-queued path
+    SET_LOW(AhciNcqFailed, GET_LOW(AhciNcqFailed) | port_gf->ncq_failbit);
+
+    // Stopping the port clears PxSACT and PxCI of all outstanding commands
+    ahci_port_recover(ctrl, pnr, 0);
+
+    // The device aborts all commands until the NCQ command error log
+    // (page 10h) is read, or until it is reset.
+    struct ahci_cmd_s *cmd = ahci_slot_cmd(port_gf, 0);
+    sata_prep_simple(&cmd->fis, ATA_CMD_READ_LOG_EXT);
+    cmd->fis.lba_low      = 0x10;
+    cmd->fis.sector_count = 1;
+    if (ahci_command(port_gf, 0, 0, bounce_buf_fl, DISK_SECTOR_SIZE) < 0) {
+        dprintf(2, "AHCI/%d: read ncq error log failed\n", pnr);
+        ahci_port_recover(ctrl, pnr, 1);
+        return;
+    }
+    dprintf(2, "AHCI/%d: ncq error log tag 0x%x, status 0x%x, error 0x%x\n"
+            , pnr, GET_LOWFLAT(bounce_buf_fl[0]), GET_LOWFLAT(bounce_buf_fl[2])
+            , GET_LOWFLAT(bounce_buf_fl[3]));
+}
 
-        // Clears any error bits in PxSERR to enable capturing new errors
-        val = ahci_port_readl(ctrl, pnr, PORT_SCR_ERR);
-        ahci_port_writel(ctrl, pnr, PORT_SCR_ERR, val);
+// submit the queued commands in 'slots' + wait until all have completed
+static int ahci_ncq_command(struct ahci_port_s *port_gf, u32 slots)
+{
+    struct ahci_ctrl_s *ctrl = port_gf->ctrl;
+    u32 pnr                  = port_gf->pnr;
+    u32 intbits, busy;
 
-        // Clears status bits in PxIS as appropriate
-        val = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
-        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, val);
+    dprintf(8, "AHCI/%d: send ncq slots 0x%x ...\n", pnr, slots);
+    intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+    if (intbits)
+        ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+    ahci_port_writel(ctrl, pnr, PORT_SCR_ACT, slots);
+    ahci_port_writel(ctrl, pnr, PORT_CMD_ISSUE, slots);
 
-        // If PxTFD.STS.BSY or PxTFD.STS.DRQ is set to 1, issue
-        // a COMRESET to the device to put it in an idle state
-        val = ahci_port_readl(ctrl, pnr, PORT_TFDATA);
-        if (val & (ATA_CB_STAT_BSY | ATA_CB_STAT_DRQ)) {
-            dprintf(2, "AHCI/%d: issue comreset\n", pnr);
-            val = ahci_port_readl(ctrl, pnr, PORT_SCR_CTL);
-            // set Device Detection Initialization (DET) to 1 for 1 ms for comreset
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val | 1);
-            mdelay (1);
-            ahci_port_writel(ctrl, pnr, PORT_SCR_CTL, val);
+    // The device clears PxSACT bits (via set device bits fis) as the
+    // queued commands complete.
+    u32 end = timer_calc(AHCI_REQUEST_TIMEOUT);
+    for (;;) {
+        intbits = ahci_port_readl(ctrl, pnr, PORT_IRQ_STAT);
+        if (intbits)
+            ahci_port_writel(ctrl, pnr, PORT_IRQ_STAT, intbits);
+        if (intbits & (PORT_IRQ_TF_ERR | PORT_IRQ_HBUS_DATA_ERR
+                       | PORT_IRQ_HBUS_ERR | PORT_IRQ_IF_ERR)) {
+            dprintf(2, "AHCI/%d: ... ncq error, intbits 0x%x, tf 0x%x\n"
+                    , pnr, intbits, ahci_port_readl(ctrl, pnr, PORT_TFDATA));
+            break;
         }
-
-        // Sets PxCMD.ST to 1 to enable issuing new commands
-        val = ahci_port_readl(ctrl, pnr, PORT_CMD);
-        ahci_port_writel(ctrl, pnr, PORT_CMD, val | PORT_CMD_START);
+        busy = ((ahci_port_readl(ctrl, pnr, PORT_SCR_ACT)
+                 | ahci_port_readl(ctrl, pnr, PORT_CMD_ISSUE)) & slots);
+        if (!busy) {
+            dprintf(8, "AHCI/%d: ... ncq finished, OK\n", pnr);
+            return 0;
+        }
+        if (timer_check(end)) {
+            warn_timeout();
+            break;
+        }
+        yield();
     }
-    return success ? 0 : -1;
+
+    ahci_ncq_recover(port_gf);
+    return -1;
 }
 
 #define CDROM_CDB_SIZE 12
@@ -218,7 +353,7 @@ int ahci_atapi_process_op(struct disk_op_s *op)
 
     struct ahci_port_s *port_gf = container_of(
         op->drive_fl, struct ahci_port_s, drive);
-    struct ahci_cmd_s *cmd = port_gf->cmd;
+    struct ahci_cmd_s *cmd = ahci_slot_cmd(port_gf, 0);
 
     if (op->command == CMD_WRITE || op->command == CMD_FORMAT)
         return DISK_RET_EWRITEPROTECT;
@@ -232,15 +367,58 @@ int ahci_atapi_process_op(struct disk_op_s *op)
     return DISK_RET_SUCCESS;
 }
 
+// read/write count blocks using native command queuing, spreading the
+// request over the port's command slots.  op->buf_fl must be word aligned
+static int
+ahci_disk_readwrite_ncq(struct disk_op_s *op, int iswrite)
+{
+    struct ahci_port_s *port_gf = container_of(
+        op->drive_fl, struct ahci_port_s, drive);
+    u32 nslots = port_gf->ncq_slots;
+    u32 chunk = DIV_ROUND_UP(op->count, nslots);
+    if (chunk < AHCI_NCQ_MIN_SECTORS)
+        chunk = AHCI_NCQ_MIN_SECTORS;
+    if (chunk > AHCI_MAX_XFER_SECTORS)
+        chunk = AHCI_MAX_XFER_SECTORS;
+
+    u64 lba = op->lba;
+    u8 *buf = op->buf_fl;
+    u32 remaining = op->count;
+    while (remaining) {
+        u32 slot, slots = 0;
+        for (slot = 0; slot < nslots && remaining; slot++) {
+            u32 count = remaining < chunk ? remaining : chunk;
+            u32 bsize = count * DISK_SECTOR_SIZE;
+            sata_prep_fpdma(&ahci_slot_cmd(port_gf, slot)->fis, lba, count
+                            , slot, iswrite);
+            ahci_prep_slot(port_gf, slot, iswrite, 0, buf, bsize);
+            slots |= 1 << slot;
+            lba += count;
+            buf += bsize;
+            remaining -= count;
+        }
+        int rc = ahci_ncq_command(port_gf, slots);
+        dprintf(8, "ahci ncq %s, lba %6x, slots 0x%x, chunk %3x, rc %d\n",
+                iswrite ? "write" : "read", (u32)op->lba, slots, chunk, rc);
+        if (rc < 0)
+            return DISK_RET_EBADTRACK;
+    }
+    return DISK_RET_SUCCESS;
+}
+
 // read/write count blocks from a harddrive, op->buf_fl must be word aligned
 static int
 ahci_disk_readwrite_aligned(struct disk_op_s *op, int iswrite)
 {
     struct ahci_port_s *port_gf = container_of(
         op->drive_fl, struct ahci_port_s, drive);
-    struct ahci_cmd_s *cmd = port_gf->cmd;
+    struct ahci_cmd_s *cmd = ahci_slot_cmd(port_gf, 0);
     int rc;
 
+    if (port_gf->ncq_slots
+        && !(GET_LOW(AhciNcqFailed) & port_gf->ncq_failbit))
+        return ahci_disk_readwrite_ncq(op, iswrite);
+
     sata_prep_readwrite(&cmd->fis, op, iswrite);
     rc = ahci_command(port_gf, iswrite, 0, op->buf_fl,
                       op->count * DISK_SECTOR_SIZE);
@@ -259,35 +437,28 @@ ahci_disk_readwrite(struct disk_op_s *op, int iswrite)
     if (((u32) op->buf_fl & 1) == 0)
         return ahci_disk_readwrite_aligned(op, iswrite);
 
-    // Use a word aligned buffer for AHCI I/O
-    int rc;
+    // Prd entries must be word aligned, so bounce the data through a word
+    // aligned buffer, moving as many sectors per command as it holds.
     struct disk_op_s localop = *op;
-    u8 *alignedbuf_fl = bounce_buf_fl;
     u8 *position = op->buf_fl;
-
-    localop.buf_fl = alignedbuf_fl;
-    localop.count = 1;
-
-    if (iswrite) {
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            memcpy_fl (alignedbuf_fl, position, DISK_SECTOR_SIZE);
-            rc = ahci_disk_readwrite_aligned (&localop, 1);
-            if (rc)
-                return rc;
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
-    } else { // read
-        u16 block;
-        for (block = 0; block < op->count; block++) {
-            rc = ahci_disk_readwrite_aligned (&localop, 0);
-            if (rc)
-                return rc;
-            memcpy_fl (position, alignedbuf_fl, DISK_SECTOR_SIZE);
-            position += DISK_SECTOR_SIZE;
-            localop.lba++;
-        }
+    u32 remaining = op->count;
+    localop.buf_fl = bounce_buf_fl;
+    while (remaining) {
+        u32 count = CDROM_SECTOR_SIZE / DISK_SECTOR_SIZE;
+        if (count > remaining)
+            count = remaining;
+        u32 bsize = count * DISK_SECTOR_SIZE;
+        localop.count = count;
+        if (iswrite)
+            memcpy_fl(bounce_buf_fl, position, bsize);
+        int rc = ahci_disk_readwrite_aligned(&localop, iswrite);
+        if (rc)
+            return rc;
+        if (!iswrite)
+            memcpy_fl(position, bounce_buf_fl, bsize);
+        position += bsize;
+        localop.lba += count;
+        remaining -= count;
     }
     return DISK_RET_SUCCESS;
 }
@@ -400,7 +571,8 @@ static struct ahci_port_s* ahci_port_realloc(struct ahci_port_s *port)
     free(port->cmd);
     port->list = memalign_high(1024, 1024);
     port->fis = memalign_high(256, 256);
-    port->cmd = memalign_high(256, 256);
+    port->cmd = memalign_high(AHCI_CMD_TABLE_SIZE, AHCI_CMD_TABLE_SIZE
+                              * (port->ncq_slots ? port->ncq_slots : 1));
     if (!port->list || !port->fis || !port->cmd) {
         warn_noalloc();
         free(port->list);
@@ -521,6 +693,21 @@ static int ahci_port_setup(struct ahci_port_s *port)
                               , (u32)adjsize, adjprefix);
         port->prio = bootprio_find_ata_device(ctrl->pci_tmp, pnr, 0);
 
+        // word 76 bit 8 - native command queuing, word 75 - queue depth
+        if ((ctrl->caps & HOST_CAP_NCQ) && (buffer[76] & (1 << 8))) {
+            u32 depth = (buffer[75] & 0x1f) + 1;
+            u32 hba_slots = ((ctrl->caps >> HOST_CAP_NCS_SHIFT)
+                             & HOST_CAP_NCS_MASK) + 1;
+            port->ncq_slots = depth < hba_slots ? depth : hba_slots;
+            // Each port using NCQ needs a bit in AhciNcqFailed
+            if (port->ncq_slots < 2 || AhciNcqPorts >= 32)
+                port->ncq_slots = 0;
+            else
+                port->ncq_failbit = 1 << AhciNcqPorts++;
+            dprintf(2, "AHCI/%d: ncq depth %d, hba slots %d\n",
+                    port->pnr, depth, hba_slots);
+        }
+
         s8 multi_dma = -1;
         s8 pio_mode = -1;
         s8 udma_mode = -1;
@@ -627,8 +814,9 @@ ahci_port_detect(void *data)
 
 // Initialize an ata controller and detect its drives.
 static void
-ahci_controller_setup(struct pci_device *pci)
+ahci_controller_setup(void *data)
 {
+    struct pci_device *pci = data;
     struct ahci_port_s *port;
     u32 val, pnr, max;
 
@@ -683,7 +871,7 @@ ahci_scan(void)
             continue;
         if (pci->prog_if != 1 /* AHCI rev 1 */)
             continue;
-        ahci_controller_setup(pci);
+        boot_probe_pci(ahci_controller_setup, pci);
     }
 }
 
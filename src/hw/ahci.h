@@ -77,6 +77,8 @@ struct ahci_port_s {
     struct ahci_cmd_s  *cmd;
     u32                pnr;
     u32                atapi;
+    u32                ncq_slots;
+    u32                ncq_failbit;
     char               *desc;
     int                prio;
 };
@@ -85,6 +87,10 @@ void ahci_setup(void);
 int ahci_process_op(struct disk_op_s *op);
 int ahci_atapi_process_op(struct disk_op_s *op);
 
+/* command table size (header plus prdt) and slots per port */
+#define AHCI_CMD_TABLE_SIZE       256
+#define AHCI_MAX_SLOTS            32
+
 #define AHCI_IRQ_ON_SG            (1 << 31)
 #define AHCI_CMD_ATAPI            (1 << 5)
 #define AHCI_CMD_WRITE            (1 << 6)
@@ -109,6 +115,8 @@ int ahci_atapi_process_op(struct disk_op_s *op);
 #define HOST_CTL_AHCI_EN          (1 << 31) /* AHCI enabled */
 
 /* HOST_CAP bits */
+#define HOST_CAP_NCS_SHIFT        8         /* number of command slots - 1 */
+#define HOST_CAP_NCS_MASK         0x1f
 #define HOST_CAP_SSC              (1 << 14) /* Slumber capable */
 #define HOST_CAP_AHCI             (1 << 18) /* AHCI only */
 #define HOST_CAP_CLO              (1 << 24) /* Command List Override support */
@@ -354,6 +354,13 @@ struct sff_dma_prd {
     u32 count;
 };
 
+// Each channel has a prd table in low memory.  A prd entry may not cross
+// a 64KiB boundary, so a table of N entries covers any (N-1)*64KiB buffer.
+// process_op() limits 16bit requests to 64KiB, which needs at most two.
+#define ATA_DMA_PRD_COUNT   4
+#define ATA_DMA_PRD_SIZE    (ATA_DMA_PRD_COUNT * sizeof(struct sff_dma_prd))
+#define ATA_DMA_MAX_SECTORS ((ATA_DMA_PRD_COUNT-1) * 0x10000 / DISK_SECTOR_SIZE)
+
 // Check if DMA available and setup transfer if so.
 static int
 ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
@@ -369,32 +376,34 @@ ata_try_dma(struct disk_op_s *op, int iswrite, int blocksize)
         op->drive_fl, struct atadrive_s, drive);
     struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
     u16 iomaster = GET_GLOBALFLAT(chan_gf->iomaster);
-    if (! iomaster)
+    struct sff_dma_prd *origdma = GET_GLOBALFLAT(chan_gf->prd_fl);
+    if (! iomaster || ! origdma)
         return -1;
     u32 bytes = op->count * blocksize;
     if (! bytes)
         return -1;
 
     // Build PRD dma structure.
-    struct sff_dma_prd *dma = MAKE_FLATPTR(SEG_LOW, ExtraStack);
-    struct sff_dma_prd *origdma = dma;
+    struct sff_dma_prd *dma = origdma;
     while (bytes) {
-        if (dma >= &origdma[16])
+        if (dma >= &origdma[ATA_DMA_PRD_COUNT])
             // Too many descriptors..
             return -1;
         u32 count = bytes;
         u32 max = 0x10000 - (dest & 0xffff);
         if (count > max)
             count = max;
-
-        SET_LOWFLAT(dma->buf_fl, dest);
         bytes -= count;
+
+        // A byte count of zero means 64KiB.
+        u32 flags = count & 0xffff;
         if (!bytes)
             // Last descriptor.
-            count |= 1<<31;
-        dprintf(16, "dma@%p: %08x %08x\n", dma, dest, count);
+            flags |= 1<<31;
+        dprintf(16, "dma@%p: %08x %08x\n", dma, dest, flags);
+        SET_LOWFLAT(dma->buf_fl, dest);
+        SET_LOWFLAT(dma->count, flags);
         dest += count;
-        SET_LOWFLAT(dma->count, count);
         dma++;
     }
 
@@ -502,14 +511,12 @@ ata_dma_cmd_data(struct disk_op_s *op, struct ata_pio_command *cmd)
     return ata_dma_transfer(op);
 }
 
-// Read/write count blocks from a harddrive.
+// Issue a single read/write command to a harddrive.
 static int
-ata_readwrite(struct disk_op_s *op, int iswrite)
+ata_cmd_readwrite(struct disk_op_s *op, int iswrite, int usepio)
 {
     u64 lba = op->lba;
 
-    int usepio = ata_try_dma(op, iswrite, DISK_SECTOR_SIZE);
-
     struct ata_pio_command cmd;
     memset(&cmd, 0, sizeof(cmd));
 
@@ -541,12 +548,58 @@ ata_readwrite(struct disk_op_s *op, int iswrite)
     cmd.lba_high = lba >> 16;
     cmd.device = ((lba >> 24) & 0xf) | ATA_CB_DH_LBA;
 
-    int ret;
     if (usepio)
-        ret = ata_pio_cmd_data(op, iswrite, &cmd);
-    else
-        ret = ata_dma_cmd_data(op, &cmd);
-    if (ret)
+        return ata_pio_cmd_data(op, iswrite, &cmd);
+    return ata_dma_cmd_data(op, &cmd);
+}
+
+// Drives (bit ataid*2+slave) that failed a DMA transfer and use PIO.
+u32 AtaDmaFailed VARLOW;
+
+// Find a drive's bit in AtaDmaFailed - drives without one don't use DMA.
+static u32
+ata_dma_failbit(struct atadrive_s *adrive_gf)
+{
+    struct ata_channel_s *chan_gf = GET_GLOBALFLAT(adrive_gf->chan_gf);
+    u32 bit = (GET_GLOBALFLAT(chan_gf->ataid) * 2
+               + GET_GLOBALFLAT(adrive_gf->slave));
+    return bit < 32 ? 1 << bit : 0;
+}
+
+// Read/write count blocks from a harddrive.
+static int
+ata_readwrite(struct disk_op_s *op, int iswrite)
+{
+    // Use bus-master dma where possible, in chunks that fit the prd table.
+    struct atadrive_s *adrive_gf = container_of(
+        op->drive_fl, struct atadrive_s, drive);
+    u32 failbit = CONFIG_ATA_DMA ? ata_dma_failbit(adrive_gf) : 0;
+    struct disk_op_s dop = *op;
+    u16 done = 0;
+    while (CONFIG_ATA_DMA && failbit && done < op->count
+           && !(GET_LOW(AtaDmaFailed) & failbit)) {
+        dop.lba = op->lba + done;
+        dop.buf_fl = op->buf_fl + done * DISK_SECTOR_SIZE;
+        dop.count = op->count - done;
+        if (dop.count > ATA_DMA_MAX_SECTORS)
+            dop.count = ATA_DMA_MAX_SECTORS;
+        if (ata_try_dma(&dop, iswrite, DISK_SECTOR_SIZE))
+            break;
+        if (ata_cmd_readwrite(&dop, iswrite, 0)) {
+            dprintf(1, "ATA DMA failed - using PIO for this drive\n");
+            SET_LOW(AtaDmaFailed, GET_LOW(AtaDmaFailed) | failbit);
+            break;
+        }
+        done += dop.count;
+    }
+    if (done == op->count)
+        return DISK_RET_SUCCESS;
+
+    // Transfer the rest using PIO.
+    dop.lba = op->lba + done;
+    dop.buf_fl = op->buf_fl + done * DISK_SECTOR_SIZE;
+    dop.count = op->count - done;
+    if (ata_cmd_readwrite(&dop, iswrite, 1))
         return DISK_RET_EBADTRACK;
     return DISK_RET_SUCCESS;
 }
@@ -941,6 +994,15 @@ init_controller(struct pci_device *pci, int chanid, int irq
     chan_gf->pci_tmp = pci;
     chan_gf->iobase1 = port1;
     chan_gf->iobase2 = port2;
+    chan_gf->prd_fl = NULL;
+    if (CONFIG_ATA_DMA && master) {
+        // Aligning the prd table to its size keeps it within 64KiB.
+        chan_gf->prd_fl = memalign_low(ATA_DMA_PRD_SIZE, ATA_DMA_PRD_SIZE);
+        if (!chan_gf->prd_fl) {
+            warn_noalloc();
+            master = 0;
+        }
+    }
     chan_gf->iomaster = master;
     dprintf(1, "ATA controller %d at %x/%x/%x (irq %d dev %x)\n"
             , ataid, port1, port2, master, irq, chan_gf->pci_bdf);
@@ -9,13 +9,103 @@
 #include "blockcmd.h" // struct cdb_request_sense
 #include "byteorder.h" // be32_to_cpu
 #include "farptr.h" // GET_FLATPTR
+#include "list.h" // hlist_node
 #include "output.h" // dprintf
+#include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_EPARAM
 #include "string.h" // memset
 #include "util.h" // timer_calc
 #include "malloc.h"
 
 
+/****************************************************************
+ * Parallel target scanning
+ ****************************************************************/
+
+// Maximum number of targets of one controller probed at the same time.
+#define SCSI_SCAN_THREADS 8
+
+struct scsi_scan_s {
+    struct hlist_node node;
+    struct drive_s *tmpl_drv;
+    scsi_scan_target scan_target;
+    struct mutex_s lock;
+    u32 next, targets, threads;
+    int found;
+};
+
+// Parallel scans in progress (only modified during POST)
+static struct hlist_head ScsiScanList;
+
+// Find the parallel scan (if any) probing the controller of a drive.
+static struct scsi_scan_s *
+scsi_find_scan(struct drive_s *drive)
+{
+    struct scsi_scan_s *scan;
+    hlist_for_each_entry(scan, &ScsiScanList, node) {
+        if (scan->tmpl_drv->type == drive->type
+            && scan->tmpl_drv->cntl_id == drive->cntl_id)
+            return scan;
+    }
+    return NULL;
+}
+
+// Issue a request while setting up a drive.  Requests to a controller
+// that is being scanned in parallel are serialized, as the drivers
+// only support one outstanding request per controller.
+int
+scsi_setup_op(struct disk_op_s *op)
+{
+    ASSERT32FLAT();
+    struct scsi_scan_s *scan = scsi_find_scan(op->drive_fl);
+    if (!scan)
+        return process_op(op);
+    mutex_lock(&scan->lock);
+    int ret = process_op(op);
+    mutex_unlock(&scan->lock);
+    return ret;
+}
+
+static void
+scsi_scan_thread(void *data)
+{
+    struct scsi_scan_s *scan = data;
+    while (scan->next < scan->targets) {
+        u32 target = scan->next++;
+        scan->found += scan->scan_target(target, scan->tmpl_drv);
+    }
+    scan->threads--;
+}
+
+// Probe targets 0 to @targets-1 by calling @scan_target for each, with
+// up to SCSI_SCAN_THREADS probes in flight.  Returns the sum of the
+// values returned by @scan_target.  Drivers set drive_s.unit_id so the
+// boot list order does not depend on which probe finishes first.
+int
+scsi_parallel_scan(struct drive_s *tmpl_drv, u32 targets
+                   , scsi_scan_target scan_target)
+{
+    ASSERT32FLAT();
+    struct scsi_scan_s scan;
+    memset(&scan, 0, sizeof(scan));
+    scan.tmpl_drv = tmpl_drv;
+    scan.scan_target = scan_target;
+    scan.targets = targets;
+    hlist_add_head(&scan.node, &ScsiScanList);
+
+    int i;
+    for (i = 0; i < SCSI_SCAN_THREADS && i < targets; i++) {
+        scan.threads++;
+        run_thread(scsi_scan_thread, &scan);
+    }
+    while (scan.threads)
+        yield();
+
+    hlist_del(&scan.node);
+    return scan.found;
+}
+
+
 /****************************************************************
  * Low level command requests
  ****************************************************************/
@@ -32,7 +122,7 @@ cdb_get_inquiry(struct disk_op_s *op, struct cdbres_inquiry *data)
     op->buf_fl = data;
     op->cdbcmd = &cmd;
     op->blocksize = sizeof(*data);
-    return process_op(op);
+    return scsi_setup_op(op);
 }
 
 // Request SENSE
@@ -48,7 +138,7 @@ cdb_get_sense(struct disk_op_s *op, struct cdbres_request_sense *data)
     op->buf_fl = data;
     op->cdbcmd = &cmd;
     op->blocksize = sizeof(*data);
-    return process_op(op);
+    return scsi_setup_op(op);
 }
 
 // Test unit ready
@@ -63,7 +153,7 @@ cdb_test_unit_ready(struct disk_op_s *op)
     op->buf_fl = NULL;
     op->cdbcmd = &cmd;
     op->blocksize = 0;
-    return process_op(op);
+    return scsi_setup_op(op);
 }
 
 // Request capacity
@@ -78,7 +168,7 @@ cdb_read_capacity(struct disk_op_s *op, struct cdbres_read_capacity *data)
     op->buf_fl = data;
     op->cdbcmd = &cmd;
     op->blocksize = sizeof(*data);
-    return process_op(op);
+    return scsi_setup_op(op);
 }
 
 // Mode sense, geometry page.
@@ -96,7 +186,7 @@ cdb_mode_sense_geom(struct disk_op_s *op, struct cdbres_mode_sense_geom *data)
     op->buf_fl = data;
     op->cdbcmd = &cmd;
     op->blocksize = sizeof(*data);
-    return process_op(op);
+    return scsi_setup_op(op);
 }
 
 
@@ -242,7 +332,7 @@ int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun)
         }
 
         cdb.length = cpu_to_be32(op.blocksize);
-        if (process_op(&op) != DISK_RET_SUCCESS)
+        if (scsi_setup_op(&op) != DISK_RET_SUCCESS)
             goto out;
 
         resp = op.buf_fl;
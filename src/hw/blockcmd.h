@@ -110,5 +110,9 @@ typedef int (*scsi_add_lun)(u32 lun, struct drive_s *tmpl_drv);
 int scsi_rep_luns_scan(struct drive_s *tmp_drive, scsi_add_lun add_lun);
 int scsi_sequential_scan(struct drive_s *tmp_drive, u32 maxluns,
                          scsi_add_lun add_lun);
+int scsi_setup_op(struct disk_op_s *op);
+typedef int (*scsi_scan_target)(u32 target, struct drive_s *tmpl_drv);
+int scsi_parallel_scan(struct drive_s *tmpl_drv, u32 targets
+                       , scsi_scan_target scan_target);
 
 #endif // blockcmd.h
@@ -160,6 +160,7 @@ esp_scsi_init_lun(struct esp_lun_s *llun, struct pci_device *pci, u32 iobase,
     memset(llun, 0, sizeof(*llun));
     llun->drive.type = DTYPE_ESP_SCSI;
     llun->drive.cntl_id = pci->bdf;
+    llun->drive.unit_id = (target << 16) | lun;
     llun->pci = pci;
     llun->target = target;
     llun->lun = lun;
@@ -195,14 +196,17 @@ fail:
     return -1;
 }
 
-static void
-esp_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+esp_scsi_scan_target(u32 target, struct drive_s *tmpl_drv)
 {
+    struct esp_lun_s *tmpl_llun =
+        container_of(tmpl_drv, struct esp_lun_s, drive);
     struct esp_lun_s llun0;
 
-    esp_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    esp_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    scsi_rep_luns_scan(&llun0.drive, esp_scsi_add_lun);
+    int ret = scsi_rep_luns_scan(&llun0.drive, esp_scsi_add_lun);
+    return ret < 0 ? 0 : ret;
 }
 
 static void
@@ -219,9 +223,9 @@ init_esp_scsi(void *data)
     // reset
     outb(ESP_CMD_RESET, iobase + ESP_CMD);
 
-    int i;
-    for (i = 0; i <= 7; i++)
-        esp_scsi_scan_target(pci, iobase, i);
+    struct esp_lun_s tmpl;
+    esp_scsi_init_lun(&tmpl, pci, iobase, 0, 0);
+    scsi_parallel_scan(&tmpl.drive, 8, esp_scsi_scan_target);
 }
 
 void
@@ -238,6 +242,6 @@ esp_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_AMD
             || pci->device != PCI_DEVICE_ID_AMD_SCSI)
             continue;
-        run_thread(init_esp_scsi, pci);
+        boot_probe_pci(init_esp_scsi, pci);
     }
 }
@@ -139,6 +139,7 @@ lsi_scsi_init_lun(struct lsi_lun_s *llun, struct pci_device *pci, u32 iobase,
     memset(llun, 0, sizeof(*llun));
     llun->drive.type = DTYPE_LSI_SCSI;
     llun->drive.cntl_id = pci->bdf;
+    llun->drive.unit_id = (target << 16) | lun;
     llun->pci = pci;
     llun->target = target;
     llun->lun = lun;
@@ -174,15 +175,19 @@ fail:
     return -1;
 }
 
-static void
-lsi_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+lsi_scsi_scan_target(u32 target, struct drive_s *tmpl_drv)
 {
+    struct lsi_lun_s *tmpl_llun =
+        container_of(tmpl_drv, struct lsi_lun_s, drive);
     struct lsi_lun_s llun0;
 
-    lsi_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    lsi_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    if (scsi_rep_luns_scan(&llun0.drive, lsi_scsi_add_lun) < 0)
-        scsi_sequential_scan(&llun0.drive, 8, lsi_scsi_add_lun);
+    int ret = scsi_rep_luns_scan(&llun0.drive, lsi_scsi_add_lun);
+    if (ret < 0)
+        ret = scsi_sequential_scan(&llun0.drive, 8, lsi_scsi_add_lun);
+    return ret;
 }
 
 static void
@@ -199,9 +204,9 @@ init_lsi_scsi(void *data)
     // reset
     outb(LSI_ISTAT0_SRST, iobase + LSI_REG_ISTAT0);
 
-    int i;
-    for (i = 0; i < 7; i++)
-        lsi_scsi_scan_target(pci, iobase, i);
+    struct lsi_lun_s tmpl;
+    lsi_scsi_init_lun(&tmpl, pci, iobase, 0, 0);
+    scsi_parallel_scan(&tmpl.drive, 7, lsi_scsi_scan_target);
 }
 
 void
@@ -218,6 +223,6 @@ lsi_scsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_LSI_LOGIC
             || pci->device != PCI_DEVICE_ID_LSI_53C895A)
             continue;
-        run_thread(init_lsi_scsi, pci);
+        boot_probe_pci(init_lsi_scsi, pci);
     }
 }
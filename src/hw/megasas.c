@@ -215,6 +215,7 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     memset(mlun, 0, sizeof(*mlun));
     mlun->drive.type = DTYPE_MEGASAS;
     mlun->drive.cntl_id = pci->bdf;
+    mlun->drive.unit_id = (target << 16) | lun;
     mlun->pci_id = pci->device;
     mlun->target = target;
     mlun->lun = lun;
@@ -240,6 +241,28 @@ megasas_add_lun(struct pci_device *pci, u32 iobase, u8 target, u8 lun)
     return ret;
 }
 
+struct megasas_scan_s {
+    struct drive_s drive;
+    struct pci_device *pci;
+    u32 iobase;
+    struct mfi_ld_list_s *ld_list;
+};
+
+static int megasas_scan_ld(u32 idx, struct drive_s *tmpl_drv)
+{
+    struct megasas_scan_s *scan =
+        container_of(tmpl_drv, struct megasas_scan_s, drive);
+    struct mfi_ld_list_s *ld_list = scan->ld_list;
+
+    dprintf(2, "LD %d:%d state 0x%x\n",
+            ld_list->lds[idx].target, ld_list->lds[idx].lun,
+            ld_list->lds[idx].state);
+    if (ld_list->lds[idx].state == 0)
+        return 0;
+    return megasas_add_lun(scan->pci, scan->iobase, ld_list->lds[idx].target,
+                           ld_list->lds[idx].lun) == 0;
+}
+
 static void megasas_scan_target(struct pci_device *pci, u32 iobase)
 {
     struct mfi_ld_list_s ld_list;
@@ -264,16 +287,14 @@ static void megasas_scan_target(struct pci_device *pci, u32 iobase)
 
     if (megasas_fire_cmd(pci->device, iobase, frame) == 0) {
         dprintf(2, "%d LD found\n", ld_list.count);
-        int i;
-        for (i = 0; i < ld_list.count; i++) {
-            dprintf(2, "LD %d:%d state 0x%x\n",
-                    ld_list.lds[i].target, ld_list.lds[i].lun,
-                    ld_list.lds[i].state);
-            if (ld_list.lds[i].state != 0) {
-                megasas_add_lun(pci, iobase,
-                                ld_list.lds[i].target, ld_list.lds[i].lun);
-            }
-        }
+        struct megasas_scan_s scan;
+        memset(&scan, 0, sizeof(scan));
+        scan.drive.type = DTYPE_MEGASAS;
+        scan.drive.cntl_id = pci->bdf;
+        scan.pci = pci;
+        scan.iobase = iobase;
+        scan.ld_list = &ld_list;
+        scsi_parallel_scan(&scan.drive, ld_list.count, megasas_scan_ld);
     }
 }
 
@@ -401,6 +422,6 @@ megasas_setup(void)
             pci->device == PCI_DEVICE_ID_DELL_PERC5 ||
             pci->device == PCI_DEVICE_ID_LSI_SAS2208 ||
             pci->device == PCI_DEVICE_ID_LSI_SAS3108)
-            run_thread(init_megasas, pci);
+            boot_probe_pci(init_megasas, pci);
     }
 }
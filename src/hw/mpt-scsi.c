@@ -202,6 +202,7 @@ mpt_scsi_init_lun(struct mpt_lun_s *llun, struct pci_device *pci,
     memset(llun, 0, sizeof(*llun));
     llun->drive.type = DTYPE_MPT_SCSI;
     llun->drive.cntl_id = pci->bdf;
+    llun->drive.unit_id = (target << 16) | lun;
     llun->pci = pci;
     llun->target = target;
     llun->lun = lun;
@@ -238,15 +239,19 @@ fail:
     return -1;
 }
 
-static void
-mpt_scsi_scan_target(struct pci_device *pci, u32 iobase, u8 target)
+static int
+mpt_scsi_scan_target(u32 target, struct drive_s *tmpl_drv)
 {
+    struct mpt_lun_s *tmpl_llun =
+        container_of(tmpl_drv, struct mpt_lun_s, drive);
     struct mpt_lun_s llun0;
 
-    mpt_scsi_init_lun(&llun0, pci, iobase, target, 0);
+    mpt_scsi_init_lun(&llun0, tmpl_llun->pci, tmpl_llun->iobase, target, 0);
 
-    if (scsi_rep_luns_scan(&llun0.drive, mpt_scsi_add_lun) < 0)
-        scsi_sequential_scan(&llun0.drive, 8, mpt_scsi_add_lun);
+    int ret = scsi_rep_luns_scan(&llun0.drive, mpt_scsi_add_lun);
+    if (ret < 0)
+        ret = scsi_sequential_scan(&llun0.drive, 8, mpt_scsi_add_lun);
+    return ret;
 }
 
 static inline void
@@ -295,9 +300,9 @@ init_mpt_scsi(void *data)
     // Post reply message used for SCSI errors
     outl((u32)&reply_msg[0], iobase + MPT_REG_REP_Q);
 
-    int i;
-    for (i = 0; i < 7; i++)
-        mpt_scsi_scan_target(pci, iobase, i);
+    struct mpt_lun_s tmpl;
+    mpt_scsi_init_lun(&tmpl, pci, iobase, 0, 0);
+    scsi_parallel_scan(&tmpl.drive, 7, mpt_scsi_scan_target);
 }
 
 void
@@ -316,6 +321,6 @@ mpt_scsi_setup(void)
             && (pci->device == PCI_DEVICE_ID_LSI_53C1030
                 || pci->device == PCI_DEVICE_ID_LSI_SAS1068
                 || pci->device == PCI_DEVICE_ID_LSI_SAS1068E))
-            run_thread(init_mpt_scsi, pci);
+            boot_probe_pci(init_mpt_scsi, pci);
     }
 }
@@ -97,6 +97,10 @@ struct nvme_ctrl {
 
     u32 doorbell_stride;        /* in bytes */
 
+    /* Largest data transfer of a single command in bytes. This honors MDTS
+       and is capped to what a single page PRP list can describe. */
+    u32 max_xfer_size;
+
     struct nvme_sq admin_sq;
     struct nvme_cq admin_cq;
 
@@ -105,6 +109,10 @@ struct nvme_ctrl {
 
     struct nvme_sq io_sq;
     struct nvme_cq io_cq;
+
+    /* NVME_MAX_INFLIGHT page aligned PRP lists, one for each I/O command
+       that may be outstanding at the same time. */
+    u64 *prpl;
 };
 
 struct nvme_namespace {
@@ -118,6 +126,9 @@ struct nvme_namespace {
     u32 block_size;
     u32 metadata_size;
 
+    /* Maximum number of blocks a single I/O command may transfer. */
+    u16 max_req_size;
+
     /* Page aligned buffer of size NVME_PAGE_SIZE. */
     char *dma_buffer;
 };
@@ -130,8 +141,12 @@ struct nvme_identify_ctrl {
     char sn[20];
     char mn[40];
     char fr[8];
+    u8 rab;
+    u8 ieee[3];
+    u8 cmic;
+    u8 mdts;                    /* max data transfer size (2^n min pages) */
 
-    char _boring[516 - 72];
+    char _boring[516 - 78];
 
     u32 nn;                     /* number of namespaces */
 };
@@ -169,6 +184,7 @@ union nvme_identify {
 /* NVMe constants */
 
 #define NVME_CAP_CSS_NVME (1ULL << 37)
+#define NVME_CAP_MPSMIN(cap) (((cap) >> 48) & 0xF)
 
 #define NVME_CSTS_FATAL   (1U <<  1)
 #define NVME_CSTS_RDY     (1U <<  0)
@@ -189,6 +205,13 @@ union nvme_identify {
 #define NVME_CQE_DW3_P (1U << 16)
 
 #define NVME_PAGE_SIZE 4096
+#define NVME_PAGE_MASK (~(NVME_PAGE_SIZE - 1))
+
+/* Number of entries in a single page PRP list. */
+#define NVME_PRPL_ENTRIES (NVME_PAGE_SIZE / sizeof(u64))
+
+/* Maximum number of I/O commands outstanding for a single disk request. */
+#define NVME_MAX_INFLIGHT 8
 
 /* Length for the queue entries. */
 #define NVME_SQE_SIZE_LOG 6
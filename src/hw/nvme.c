@@ -126,16 +126,21 @@ nvme_consume_cqe(struct nvme_sq *sq)
         dprintf(4, "sq %p advanced to %u\n", sq, cqe->sq_head);
     }
 
-    /* Tell the controller that we consumed the completion. */
-    writel(cq->common.dbl, cq->head);
-
     return *cqe;
 }
 
+/* Tell the controller that we consumed all completions up to cq->head. */
+static void
+nvme_ack_cq(struct nvme_cq *cq)
+{
+    writel(cq->common.dbl, cq->head);
+}
+
+static const unsigned nvme_timeout = 5000 /* ms */;
+
 static struct nvme_cqe
 nvme_wait(struct nvme_sq *sq)
 {
-    static const unsigned nvme_timeout = 5000 /* ms */;
     u32 to = timer_calc(nvme_timeout);
     while (!nvme_poll_cq(sq->cq)) {
         yield();
@@ -146,15 +151,51 @@ nvme_wait(struct nvme_sq *sq)
         }
     }
 
-    return nvme_consume_cqe(sq);
+    struct nvme_cqe cqe = nvme_consume_cqe(sq);
+    nvme_ack_cq(sq->cq);
+    return cqe;
+}
+
+/* Wait for count outstanding commands on sq to complete. All completions
+   that are ready are reaped before the completion doorbell is written.
+   Returns the number of commands that failed or did not complete. */
+static int
+nvme_wait_many(struct nvme_sq *sq, int count)
+{
+    int failed = 0;
+    u32 to = timer_calc(nvme_timeout);
+    while (count) {
+        if (!nvme_poll_cq(sq->cq)) {
+            if (timer_check(to)) {
+                warn_timeout();
+                return failed + count;
+            }
+            yield();
+            continue;
+        }
+
+        while (count && nvme_poll_cq(sq->cq)) {
+            struct nvme_cqe cqe = nvme_consume_cqe(sq);
+            if (!nvme_is_cqe_success(&cqe)) {
+                dprintf(2, "nvme io: %08x %08x %08x %08x\n",
+                        cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+                failed++;
+            }
+            count--;
+        }
+        nvme_ack_cq(sq->cq);
+    }
+
+    return failed;
 }
 
 /* Returns the next submission queue entry (or NULL if the queue is full). It
-   also fills out Command Dword 0 and clears the rest. */
+   also fills out Command Dword 0, the data pointers and clears the rest. */
 static struct nvme_sqe *
-nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
+nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data,
+                  void *data2)
 {
-    if (((sq->head + 1) & sq->common.mask) == sq->tail) {
+    if (((sq->tail + 1) & sq->common.mask) == sq->head) {
         dprintf(3, "submission queue is full");
         return NULL;
     }
@@ -166,24 +207,45 @@ nvme_get_next_sqe(struct nvme_sq *sq, u8 opc, void *metadata, void *data)
     sqe->cdw0 = opc | (sq->tail << 16 /* CID */);
     sqe->mptr = (u32)metadata;
     sqe->dptr_prp1 = (u32)data;
+    sqe->dptr_prp2 = (u32)data2;
+
+    if (sqe->dptr_prp1 & 0x3) {
+        /* Data buffer not dword aligned. */
+        warn_internalerror();
+    }
 
-    if (sqe->dptr_prp1 & (NVME_PAGE_SIZE - 1)) {
-        /* Data buffer not page aligned. */
+    if (sqe->dptr_prp2 & ~NVME_PAGE_MASK) {
+        /* The second data pointer must always be page aligned. */
         warn_internalerror();
     }
 
     return sqe;
 }
 
-/* Call this after you've filled out an sqe that you've got from nvme_get_next_sqe. */
+/* Call this after you've filled out an sqe that you've got from
+   nvme_get_next_sqe. The controller only picks it up after nvme_ring_sq. */
 static void
-nvme_commit_sqe(struct nvme_sq *sq)
+nvme_queue_sqe(struct nvme_sq *sq)
 {
-    dprintf(4, "sq %p commit_sqe %u\n", sq, sq->tail);
+    dprintf(4, "sq %p queue_sqe %u\n", sq, sq->tail);
     sq->tail = (sq->tail + 1) & sq->common.mask;
+}
+
+/* Tell the controller about all queued submission queue entries. */
+static void
+nvme_ring_sq(struct nvme_sq *sq)
+{
     writel(sq->common.dbl, sq->tail);
 }
 
+/* Queue a single sqe and hand it to the controller right away. */
+static void
+nvme_commit_sqe(struct nvme_sq *sq)
+{
+    nvme_queue_sqe(sq);
+    nvme_ring_sq(sq);
+}
+
 /* Perform an identify command on the admin queue and return the resulting
    buffer. This may be a NULL pointer, if something failed. This function
    cannot be used after initialization, because it uses buffers in tmp zone. */
@@ -200,7 +262,7 @@ nvme_admin_identify(struct nvme_ctrl *ctrl, u8 cns, u32 nsid)
     struct nvme_sqe *cmd_identify;
     cmd_identify = nvme_get_next_sqe(&ctrl->admin_sq,
                                      NVME_SQE_OPC_ADMIN_IDENTIFY, NULL,
-                                     identify_buf);
+                                     identify_buf, NULL);
 
     if (!cmd_identify) {
         warn_internalerror();
@@ -275,6 +337,8 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
         goto free_buffer;
     }
 
+    ns->max_req_size = ctrl->max_xfer_size / ns->block_size;
+
     ns->drive.cntl_id   = ns - ctrl->ns;
     ns->drive.removable = 0;
     ns->drive.type      = DTYPE_NVME;
@@ -282,6 +346,10 @@ nvme_probe_ns(struct nvme_ctrl *ctrl, struct nvme_namespace *ns, u32 ns_id)
     ns->drive.sectors   = ns->lba_count;
 
     ns->dma_buffer = zalloc_page_aligned(&ZoneHigh, NVME_PAGE_SIZE);
+    if (!ns->dma_buffer) {
+        warn_noalloc();
+        goto free_buffer;
+    }
 
     char *desc = znprintf(MAXDESCSIZE, "NVMe NS %u: %llu MiB (%llu %u-byte "
                           "blocks + %u-byte metadata)\n",
@@ -329,7 +397,7 @@ nvme_create_io_cq(struct nvme_ctrl *ctrl, struct nvme_cq *cq, u16 q_idx)
 
     cmd_create_cq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_CQ, NULL,
-                                      cq->cqe);
+                                      cq->cqe, NULL);
     if (!cmd_create_cq) {
         goto err_destroy_cq;
     }
@@ -373,7 +441,7 @@ nvme_create_io_sq(struct nvme_ctrl *ctrl, struct nvme_sq *sq, u16 q_idx, struct
 
     cmd_create_sq = nvme_get_next_sqe(&ctrl->admin_sq,
                                       NVME_SQE_OPC_ADMIN_CREATE_IO_SQ, NULL,
-                                      sq->sqe);
+                                      sq->sqe, NULL);
     if (!cmd_create_sq) {
         goto err_destroy_sq;
     }
@@ -401,41 +469,69 @@ err:
     return -1;
 }
 
-/* Reads count sectors into buf. Returns DISK_RET_*. The buffer cannot cross
-   page boundaries. */
+/* Queue a read or write of count sectors at buf on the I/O queue, using prpl
+   as PRP list if needed. The command is not submitted until the caller rings
+   the doorbell. The buffer has to be dword aligned and count cannot exceed the
+   namespace's max_req_size. Returns 0 on success. */
 static int
-nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
-                  int write)
+nvme_io_queue(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+              int write, u64 *prpl)
 {
     u32 buf_addr = (u32)buf;
+    u32 size = ns->block_size * count;
 
-    if ((buf_addr & 0x3) ||
-        ((buf_addr & ~(NVME_PAGE_SIZE - 1)) !=
-         ((buf_addr + ns->block_size * count - 1) & ~(NVME_PAGE_SIZE - 1)))) {
-        /* Buffer is misaligned or crosses page boundary */
+    if ((buf_addr & 0x3) || (count > ns->max_req_size)) {
+        /* Buffer is misaligned or the request is too large */
         warn_internalerror();
-        return DISK_RET_EBADTRACK;
+        return -1;
     }
 
     struct nvme_sqe *io_read = nvme_get_next_sqe(&ns->ctrl->io_sq,
                                                  write ? NVME_SQE_OPC_IO_WRITE
                                                        : NVME_SQE_OPC_IO_READ,
-                                                 NULL, buf);
+                                                 NULL, buf, NULL);
+    if (!io_read)
+        return -1;
+
+    /* PRP1 covers everything up to the end of the first page. Everything
+       beyond is a list of whole pages. */
+    u32 next_page = (buf_addr & NVME_PAGE_MASK) + NVME_PAGE_SIZE;
+    u32 end = buf_addr + size;
+
+    if (end > next_page + NVME_PAGE_SIZE) {
+        u32 prpl_len = 0;
+        for (; next_page < end; next_page += NVME_PAGE_SIZE)
+            prpl[prpl_len++] = next_page;
+        io_read->dptr_prp2 = (u32)prpl;
+    } else if (end > next_page) {
+        io_read->dptr_prp2 = next_page;
+    }
+
     io_read->nsid = ns->ns_id;
     io_read->dword[10] = (u32)lba;
     io_read->dword[11] = (u32)(lba >> 32);
     io_read->dword[12] = (1U << 31 /* limited retry */) | (count - 1);
 
-    nvme_commit_sqe(&ns->ctrl->io_sq);
+    nvme_queue_sqe(&ns->ctrl->io_sq);
 
-    struct nvme_cqe cqe = nvme_wait(&ns->ctrl->io_sq);
+    return 0;
+}
 
-    if (!nvme_is_cqe_success(&cqe)) {
-        dprintf(2, "read io: %08x %08x %08x %08x\n",
-                cqe.dword[0], cqe.dword[1], cqe.dword[2], cqe.dword[3]);
+/* Reads count sectors into buf and waits for completion. Returns
+   DISK_RET_*. */
+static int
+nvme_io_readwrite(struct nvme_namespace *ns, u64 lba, char *buf, u16 count,
+                  int write)
+{
+    struct nvme_sq *sq = &ns->ctrl->io_sq;
 
+    if (nvme_io_queue(ns, lba, buf, count, write, ns->ctrl->prpl))
+        return DISK_RET_EBADTRACK;
+
+    nvme_ring_sq(sq);
+
+    if (nvme_wait_many(sq, 1))
         return DISK_RET_EBADTRACK;
-    }
 
     return DISK_RET_SUCCESS;
 }
@@ -449,8 +545,17 @@ nvme_create_io_queues(struct nvme_ctrl *ctrl)
     if (nvme_create_io_sq(ctrl, &ctrl->io_sq, 2, &ctrl->io_cq))
         goto err_free_cq;
 
+    ctrl->prpl = zalloc_page_aligned(&ZoneHigh,
+                                     NVME_MAX_INFLIGHT * NVME_PAGE_SIZE);
+    if (!ctrl->prpl) {
+        warn_noalloc();
+        goto err_free_sq;
+    }
+
     return 0;
 
+ err_free_sq:
+    nvme_destroy_sq(&ctrl->io_sq);
  err_free_cq:
     nvme_destroy_cq(&ctrl->io_cq);
  err:
@@ -460,6 +565,8 @@ nvme_create_io_queues(struct nvme_ctrl *ctrl)
 static void
 nvme_destroy_io_queues(struct nvme_ctrl *ctrl)
 {
+    free(ctrl->prpl);
+    ctrl->prpl = NULL;
     nvme_destroy_sq(&ctrl->io_sq);
     nvme_destroy_cq(&ctrl->io_cq);
 }
@@ -549,6 +656,15 @@ nvme_controller_enable(struct nvme_ctrl *ctrl)
             identify->nn, (identify->nn == 1) ? "" : "s");
 
     ctrl->ns_count = identify->nn;
+
+    /* MDTS is reported in units of the minimum memory page size, zero means
+       there is no limit. */
+    ctrl->max_xfer_size = NVME_PRPL_ENTRIES * NVME_PAGE_SIZE;
+    u32 mdts_shift = identify->mdts + 12 + NVME_CAP_MPSMIN(ctrl->reg->cap);
+    if (identify->mdts && mdts_shift < 32
+        && (1U << mdts_shift) < ctrl->max_xfer_size)
+        ctrl->max_xfer_size = 1U << mdts_shift;
+    dprintf(3, "NVMe max transfer size %u bytes.\n", ctrl->max_xfer_size);
     free(identify);
 
     if ((ctrl->ns_count == 0) || nvme_create_io_queues(ctrl)) {
@@ -647,21 +763,23 @@ nvme_scan(void)
             continue;
         }
 
-        run_thread(nvme_controller_setup, pci);
+        boot_probe_pci(nvme_controller_setup, pci);
     }
 }
 
+/* Transfer through the bounce buffer, a page at a time. This is only used for
+   caller buffers the controller cannot address directly. */
 static int
-nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+nvme_bounce_readwrite(struct nvme_namespace *ns, struct disk_op_s *op,
+                      int write)
 {
     int res = DISK_RET_SUCCESS;
     u16 const max_blocks = NVME_PAGE_SIZE / ns->block_size;
-    u16 i;
+    u16 i, blocks;
 
-    for (i = 0; i < op->count && res == DISK_RET_SUCCESS;) {
+    for (i = 0; i < op->count && res == DISK_RET_SUCCESS; i += blocks) {
         u16 blocks_remaining = op->count - i;
-        u16 blocks = blocks_remaining < max_blocks ? blocks_remaining
-                                                   : max_blocks;
+        blocks = blocks_remaining < max_blocks ? blocks_remaining : max_blocks;
         char *op_buf = op->buf_fl + i * ns->block_size;
 
         if (write) {
@@ -676,13 +794,62 @@ nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
         if (!write && res == DISK_RET_SUCCESS) {
             memcpy(op_buf, ns->dma_buffer, blocks * ns->block_size);
         }
-
-        i += blocks;
     }
 
     return res;
 }
 
+/* DMA directly to and from the caller's buffer. Up to NVME_MAX_INFLIGHT
+   commands are queued before the doorbell is rung once, and their completions
+   are then reaped together. */
+static int
+nvme_direct_readwrite(struct nvme_namespace *ns, struct disk_op_s *op,
+                      int write)
+{
+    struct nvme_ctrl *ctrl = ns->ctrl;
+    u16 i = 0;
+
+    while (i < op->count) {
+        int inflight = 0;
+        while (i < op->count && inflight < NVME_MAX_INFLIGHT) {
+            u16 blocks_remaining = op->count - i;
+            u16 blocks = blocks_remaining < ns->max_req_size ? blocks_remaining
+                                                             : ns->max_req_size;
+            char *op_buf = op->buf_fl + i * ns->block_size;
+            u64 *prpl = ctrl->prpl + inflight * NVME_PRPL_ENTRIES;
+
+            if (nvme_io_queue(ns, op->lba + i, op_buf, blocks, write, prpl))
+                /* Submission queue is full, process what we have. */
+                break;
+            dprintf(3, "ns %u %s lba %llu+%u queued\n", ns->ns_id,
+                    write ? "write" : "read", op->lba + i, blocks);
+
+            i += blocks;
+            inflight++;
+        }
+
+        if (!inflight)
+            return DISK_RET_EBADTRACK;
+
+        nvme_ring_sq(&ctrl->io_sq);
+
+        if (nvme_wait_many(&ctrl->io_sq, inflight))
+            return DISK_RET_EBADTRACK;
+    }
+
+    return DISK_RET_SUCCESS;
+}
+
+static int
+nvme_cmd_readwrite(struct nvme_namespace *ns, struct disk_op_s *op, int write)
+{
+    /* Every block starts at the same alignment as the caller's buffer, as
+       block sizes are a multiple of four. */
+    if ((u32)op->buf_fl & 0x3)
+        return nvme_bounce_readwrite(ns, op, write);
+    return nvme_direct_readwrite(ns, op, write);
+}
+
 int
 nvme_process_op(struct disk_op_s *op)
 {
@@ -130,6 +130,7 @@ struct pvscsi_ring_dsc_s {
 
 struct pvscsi_lun_s {
     struct drive_s drive;
+    struct pci_device *pci;
     void *iobase;
     u8 target;
     u8 lun;
@@ -268,6 +269,8 @@ pvscsi_add_lun(struct pci_device *pci, void *iobase,
     memset(plun, 0, sizeof(*plun));
     plun->drive.type = DTYPE_PVSCSI;
     plun->drive.cntl_id = pci->bdf;
+    plun->drive.unit_id = (target << 16) | lun;
+    plun->pci = pci;
     plun->target = target;
     plun->lun = lun;
     plun->iobase = iobase;
@@ -287,12 +290,14 @@ fail:
     return -1;
 }
 
-static void
-pvscsi_scan_target(struct pci_device *pci, void *iobase,
-                   struct pvscsi_ring_dsc_s *ring_dsc, u8 target)
+static int
+pvscsi_scan_target(u32 target, struct drive_s *tmpl_drv)
 {
+    struct pvscsi_lun_s *tmpl_plun =
+        container_of(tmpl_drv, struct pvscsi_lun_s, drive);
     /* pvscsi has no more than a single lun per target */
-    pvscsi_add_lun(pci, iobase, ring_dsc, target, 0);
+    return pvscsi_add_lun(tmpl_plun->pci, tmpl_plun->iobase,
+                          tmpl_plun->ring_dsc, target, 0) == 0;
 }
 
 static void
@@ -310,9 +315,15 @@ init_pvscsi(void *data)
 
     struct pvscsi_ring_dsc_s *ring_dsc = NULL;
     pvscsi_init_rings(iobase, &ring_dsc);
-    int i;
-    for (i = 0; i < 64; i++)
-        pvscsi_scan_target(pci, iobase, ring_dsc, i);
+
+    struct pvscsi_lun_s tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.drive.type = DTYPE_PVSCSI;
+    tmpl.drive.cntl_id = pci->bdf;
+    tmpl.pci = pci;
+    tmpl.iobase = iobase;
+    tmpl.ring_dsc = ring_dsc;
+    scsi_parallel_scan(&tmpl.drive, 64, pvscsi_scan_target);
 }
 
 void
@@ -329,6 +340,6 @@ pvscsi_setup(void)
         if (pci->vendor != PCI_VENDOR_ID_VMWARE
             || pci->device != PCI_DEVICE_ID_VMWARE_PVSCSI)
             continue;
-        run_thread(init_pvscsi, pci);
+        boot_probe_pci(init_pvscsi, pci);
     }
 }
@@ -567,6 +567,6 @@ sdcard_setup(void)
         if (pci->class != PCI_CLASS_SYSTEM_SDHCI || pci->prog_if >= 2)
             // Not an SDHCI controller following SDHCI spec
             continue;
-        run_thread(sdcard_pci_setup, pci);
+        boot_probe_pci(sdcard_pci_setup, pci);
     }
 }
@@ -474,7 +474,7 @@ ehci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     // Allocate a new queue head.
     struct ehci_pipe *pipe;
     if (eptype == USB_ENDPOINT_XFER_CONTROL)
-        pipe = memalign_tmphigh(EHCI_QH_ALIGN, sizeof(*pipe));
+        pipe = memalign_high(EHCI_QH_ALIGN, sizeof(*pipe));
     else
         pipe = memalign_low(EHCI_QH_ALIGN, sizeof(*pipe));
     if (!pipe) {
@@ -541,22 +541,23 @@ ehci_fill_tdbuf(struct ehci_qtd *td, u32 dest, int transfer)
         *pos++ = dest;
 }
 
-#define STACKQTDS 6
+// Every qtd but the last of a chain moves at least 4 full pages.
+#define EHCI_QTD_MIN_XFER (4*PAGE_SIZE)
+// Longest qtd chain built on the stack for a single transfer.
+#define EHCI_MAX_QTDS 12
 
-int
-ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
-               , void *data, int datasize)
+// Queue one chain of qtds covering the whole request and wait for it.
+static int
+ehci_send_chain(struct ehci_pipe *pipe, int dir, const void *cmd
+                , void *data, int datasize)
 {
-    if (! CONFIG_USB_EHCI)
-        return -1;
-    struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
-    dprintf(7, "ehci_send_pipe qh=%p dir=%d data=%p size=%d\n"
-            , &pipe->qh, dir, data, datasize);
-
-    // Allocate tds on stack (with required alignment)
-    u8 tdsbuf[sizeof(struct ehci_qtd) * STACKQTDS + EHCI_QTD_ALIGN - 1];
+    // Allocate tds on stack (with required alignment), sized for request
+    int count = DIV_ROUND_UP(datasize, EHCI_QTD_MIN_XFER) + (cmd ? 2 : 0);
+    if (!count)
+        count = 1;
+    u8 tdsbuf[sizeof(struct ehci_qtd) * count + EHCI_QTD_ALIGN - 1];
     struct ehci_qtd *tds = (void*)ALIGN((u32)tdsbuf, EHCI_QTD_ALIGN), *td = tds;
-    memset(tds, 0, sizeof(*tds) * STACKQTDS);
+    memset(tds, 0, sizeof(*tds) * count);
 
     // Setup transfer descriptors
     u16 maxpacket = GET_LOWFLAT(pipe->pipe.maxpacket);
@@ -574,7 +575,7 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     u32 dest = (u32)data, dataend = dest + datasize;
     while (dest < dataend) {
         // Send data pids
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= &tds[count]) {
             warn_noalloc();
             return -1;
         }
@@ -592,7 +593,7 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     }
     if (cmd) {
         // Send status pid on control transfers
-        if (td >= &tds[STACKQTDS]) {
+        if (td >= &tds[count]) {
             warn_noalloc();
             return -1;
         }
@@ -607,9 +608,9 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     (td-1)->qtd_next = EHCI_PTR_TERM;
     barrier();
     SET_LOWFLAT(pipe->qh.qtd_next, (u32)MAKE_FLATPTR(GET_SEG(SS), tds));
-    u32 end = timer_calc(usb_xfer_time(p, datasize));
-    int i;
-    for (i=0, td=tds; i<STACKQTDS; i++, td++) {
+    u32 end = timer_calc(usb_xfer_time(&pipe->pipe, datasize));
+    struct ehci_qtd *lasttd = td;
+    for (td=tds; td<lasttd; td++) {
         int ret = ehci_wait_td(pipe, td, end);
         if (ret)
             return -1;
@@ -618,6 +619,43 @@ ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
     return 0;
 }
 
+int
+ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
+               , void *data, int datasize)
+{
+    if (! CONFIG_USB_EHCI)
+        return -1;
+    struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
+    dprintf(7, "ehci_send_pipe qh=%p dir=%d data=%p size=%d\n"
+            , &pipe->qh, dir, data, datasize);
+
+    if (!cmd) {
+        // Very long bulk transfers are run as several maximum size chains
+        // to bound stack usage.
+        int maxchain = EHCI_MAX_QTDS * EHCI_QTD_MIN_XFER;
+        while (datasize > maxchain) {
+            int ret = ehci_send_chain(pipe, dir, NULL, data, maxchain);
+            if (ret)
+                return ret;
+            data += maxchain;
+            datasize -= maxchain;
+        }
+    }
+    return ehci_send_chain(pipe, dir, cmd, data, datasize);
+}
+
+// Restart the data toggle after the device endpoint was reset.
+int
+ehci_reset_endpoint(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_EHCI)
+        return -1;
+    struct ehci_pipe *pipe = container_of(p, struct ehci_pipe, pipe);
+    ehci_reset_pipe(pipe);
+    SET_LOWFLAT(pipe->qh.token, GET_LOWFLAT(pipe->qh.token) & ~QTD_TOGGLE);
+    return 0;
+}
+
 int
 ehci_poll_intr(struct usb_pipe *p, void *data)
 {
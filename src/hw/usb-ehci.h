@@ -13,6 +13,7 @@ struct usb_pipe *ehci_realloc_pipe(struct usbdevice_s *usbdev
 int ehci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
 int ehci_poll_intr(struct usb_pipe *p, void *data);
+int ehci_reset_endpoint(struct usb_pipe *p);
 
 
 /****************************************************************
@@ -10,6 +10,7 @@
 #include "config.h" // CONFIG_USB_MSC
 #include "malloc.h" // free
 #include "output.h" // dprintf
+#include "stacks.h" // call32
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
 #include "usb.h" // struct usb_s
@@ -18,8 +19,9 @@
 
 struct usbdrive_s {
     struct drive_s drive;
-    struct usb_pipe *bulkin, *bulkout;
+    struct usb_pipe *bulkin, *bulkout, *ctrl;
     int lun;
+    u8 ifnum;
 };
 
 
@@ -50,6 +52,11 @@ struct csw_s {
     u8 bCSWStatus;
 } PACKED;
 
+u32 UsbMscTag VARLOW;
+
+// Send a data stage in one bulk call.  Every controller driver accepts
+// transfers up to USB_MSC_MAX_XFER: uhci recycles its tds, ehci and
+// xhci run several qtd chains / TDs, and ohci several td batches.
 static int
 usb_msc_send(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes)
 {
@@ -61,6 +68,76 @@ usb_msc_send(struct usbdrive_s *udrive_gf, int dir, void *buf, u32 bytes)
     return usb_send_bulk(pipe, dir, buf, bytes);
 }
 
+
+/****************************************************************
+ * Error recovery
+ ****************************************************************/
+
+#define USB_MSC_RECOVER_IN    (1<<0) // Clear halt on bulk in endpoint
+#define USB_MSC_RECOVER_OUT   (1<<1) // Clear halt on bulk out endpoint
+#define USB_MSC_RECOVER_RESET (1<<2) // Bulk-only mass storage reset
+
+struct usb_msc_recover_s {
+    struct usbdrive_s *udrive_gf;
+    u32 flags;
+};
+
+static int
+usb_msc_clear_halt(struct usb_pipe *ctrl, struct usb_pipe *pipe, int dir)
+{
+    struct usb_ctrlrequest req;
+    req.bRequestType = USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT;
+    req.bRequest = USB_REQ_CLEAR_FEATURE;
+    req.wValue = 0; // ENDPOINT_HALT
+    req.wIndex = GET_LOWFLAT(pipe->ep) | dir;
+    req.wLength = 0;
+    int ret = usb_send_default_control(ctrl, &req, NULL);
+    if (ret)
+        return ret;
+    // The device restarts the endpoint at DATA0 - do the same here.
+    return usb_reset_pipe(pipe);
+}
+
+// Recover from a stalled endpoint or a confused device (32bit only).
+void VISIBLE32FLAT
+usb_msc_recover(struct usb_msc_recover_s *rec)
+{
+    ASSERT32FLAT();
+    struct usbdrive_s *udrive_gf = rec->udrive_gf;
+    struct usb_pipe *ctrl = udrive_gf->ctrl;
+    if (!ctrl)
+        return;
+    if (rec->flags & USB_MSC_RECOVER_RESET) {
+        dprintf(1, "USB MSC reset recovery\n");
+        struct usb_ctrlrequest req;
+        req.bRequestType = USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE;
+        req.bRequest = 0xff;
+        req.wValue = 0;
+        req.wIndex = udrive_gf->ifnum;
+        req.wLength = 0;
+        usb_send_default_control(ctrl, &req, NULL);
+    }
+    if (rec->flags & USB_MSC_RECOVER_IN)
+        usb_msc_clear_halt(ctrl, udrive_gf->bulkin, USB_DIR_IN);
+    if (rec->flags & USB_MSC_RECOVER_OUT)
+        usb_msc_clear_halt(ctrl, udrive_gf->bulkout, USB_DIR_OUT);
+}
+
+static void
+usb_msc_recover_flags(struct usbdrive_s *udrive_gf, u32 flags)
+{
+    struct usb_msc_recover_s rec = { udrive_gf, flags };
+    if (MODESEGMENT)
+        call32(usb_msc_recover, MAKE_FLATPTR(GET_SEG(SS), &rec), 0);
+    else
+        usb_msc_recover(&rec);
+}
+
+
+/****************************************************************
+ * Command processing
+ ****************************************************************/
+
 // Low-level usb command transmit function.
 int
 usb_process_op(struct disk_op_s *op)
@@ -80,8 +157,10 @@ usb_process_op(struct disk_op_s *op)
     if (blocksize < 0)
         return default_process_op(op);
     u32 bytes = blocksize * op->count;
+    u32 tag = GET_LOW(UsbMscTag) + 1;
+    SET_LOW(UsbMscTag, tag);
     cbw.dCBWSignature = CBW_SIGNATURE;
-    cbw.dCBWTag = 999; // XXX
+    cbw.dCBWTag = tag;
     cbw.dCBWDataTransferLength = bytes;
     cbw.bmCBWFlags = scsi_is_read(op) ? USB_DIR_IN : USB_DIR_OUT;
     cbw.bCBWLUN = GET_GLOBALFLAT(udrive_gf->lun);
@@ -91,34 +170,47 @@ usb_process_op(struct disk_op_s *op)
     int ret = usb_msc_send(udrive_gf, USB_DIR_OUT
                            , MAKE_FLATPTR(GET_SEG(SS), &cbw), sizeof(cbw));
     if (ret)
-        goto fail;
+        goto reset;
 
-    // Transfer data to/from device.
+    // Transfer data to/from device.  A stalled data stage is cleared and
+    // the device still reports its status.
+    int datafail = 0;
     if (bytes) {
         ret = usb_msc_send(udrive_gf, cbw.bmCBWFlags, op->buf_fl, bytes);
-        if (ret)
-            goto fail;
+        if (ret) {
+            datafail = 1;
+            usb_msc_recover_flags(udrive_gf, cbw.bmCBWFlags == USB_DIR_IN
+                                  ? USB_MSC_RECOVER_IN : USB_MSC_RECOVER_OUT);
+        }
     }
 
-    // Transfer csw info.
+    // Transfer csw info (retrying once after clearing a stall).
     struct csw_s csw;
     ret = usb_msc_send(udrive_gf, USB_DIR_IN
                        , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
-    if (ret)
-        goto fail;
+    if (ret) {
+        usb_msc_recover_flags(udrive_gf, USB_MSC_RECOVER_IN);
+        ret = usb_msc_send(udrive_gf, USB_DIR_IN
+                           , MAKE_FLATPTR(GET_SEG(SS), &csw), sizeof(csw));
+        if (ret)
+            goto reset;
+    }
+    if (csw.dCSWSignature != CSW_SIGNATURE || csw.dCSWTag != tag
+        || csw.bCSWStatus == 2)
+        // Invalid csw or phase error.
+        goto reset;
 
-    if (!csw.bCSWStatus)
+    if (!csw.bCSWStatus && !datafail)
         return DISK_RET_SUCCESS;
-    if (csw.bCSWStatus == 2)
-        goto fail;
 
     if (blocksize)
         op->count -= csw.dCSWDataResidue / blocksize;
     return DISK_RET_EBADTRACK;
 
-fail:
-    // XXX - reset connection
+reset:
     dprintf(1, "USB transmission failed\n");
+    usb_msc_recover_flags(udrive_gf, USB_MSC_RECOVER_RESET
+                          | USB_MSC_RECOVER_IN | USB_MSC_RECOVER_OUT);
     return DISK_RET_EBADTRACK;
 }
 
@@ -155,7 +247,9 @@ usb_msc_lun_setup(struct usb_pipe *inpipe, struct usb_pipe *outpipe,
         drive->drive.type = DTYPE_USB;
     drive->bulkin = inpipe;
     drive->bulkout = outpipe;
+    drive->ctrl = usbdev->defpipe;
     drive->lun = lun;
+    drive->ifnum = usbdev->iface->bInterfaceNumber;
 
     int prio = bootprio_find_usb(usbdev, lun);
     int ret = scsi_drive_setup(&drive->drive, "USB MSC", prio);
@@ -213,6 +307,8 @@ usb_msc_setup(struct usbdevice_s *usbdev)
     if (!pipesused)
         goto fail;
 
+    // Keep the control pipe for error recovery.
+    usbdev->defpipe = NULL;
     return 0;
 fail:
     dprintf(1, "Unable to configure USB MSC device.\n");
@@ -1,6 +1,9 @@
 #ifndef __USB_MSC_H
 #define __USB_MSC_H
 
+// Largest transfer issued as a single mass storage command.
+#define USB_MSC_MAX_XFER (120*1024)
+
 // usb-msc.c
 struct disk_op_s;
 int usb_process_op(struct disk_op_s *op);
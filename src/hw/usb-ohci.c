@@ -417,7 +417,7 @@ ohci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     // Allocate a new queue head.
     struct ohci_pipe *pipe;
     if (eptype == USB_ENDPOINT_XFER_CONTROL)
-        pipe = malloc_tmphigh(sizeof(*pipe));
+        pipe = malloc_high(sizeof(*pipe));
     else
         pipe = malloc_low(sizeof(*pipe));
     if (!pipe) {
@@ -469,65 +469,90 @@ ohci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
 
     // Allocate tds on stack (with required alignment)
     u8 tdsbuf[sizeof(struct ohci_td) * STACKOTDS + OHCI_TD_ALIGN - 1];
-    struct ohci_td *tds = (void*)ALIGN((u32)tdsbuf, OHCI_TD_ALIGN), *td = tds;
-    memset(tds, 0, sizeof(*tds) * STACKOTDS);
+    struct ohci_td *tds = (void*)ALIGN((u32)tdsbuf, OHCI_TD_ALIGN), *td;
 
-    // Setup transfer descriptors
+    // Bulk transfers needing more tds than fit on the stack are sent in
+    // several batches - the ed carries the data toggle between them.
     u16 maxpacket = pipe->pipe.maxpacket;
-    u32 toggle = 0, statuscmd = OHCI_BLF;
-    if (cmd) {
-        // Send setup pid on control transfers
-        td->hwINFO = TD_DP_SETUP | TD_T_DATA0 | TD_CC;
-        td->hwCBP = (u32)cmd;
-        td->hwNextTD = (u32)&td[1];
-        td->hwBE = (u32)cmd + USB_CONTROL_SETUP_SIZE - 1;
-        td++;
-        toggle = TD_T_DATA1;
-        statuscmd = OHCI_CLF;
-    }
     u32 dest = (u32)data, dataend = dest + datasize;
-    while (dest < dataend) {
-        // Send data pids
-        if (td >= &tds[STACKOTDS]) {
-            warn_noalloc();
-            return -1;
+    for (;;) {
+        memset(tds, 0, sizeof(*tds) * STACKOTDS);
+        td = tds;
+
+        // Setup transfer descriptors
+        u32 toggle = 0, statuscmd = OHCI_BLF, start = dest;
+        if (cmd) {
+            // Send setup pid on control transfers
+            td->hwINFO = TD_DP_SETUP | TD_T_DATA0 | TD_CC;
+            td->hwCBP = (u32)cmd;
+            td->hwNextTD = (u32)&td[1];
+            td->hwBE = (u32)cmd + USB_CONTROL_SETUP_SIZE - 1;
+            td++;
+            toggle = TD_T_DATA1;
+            statuscmd = OHCI_CLF;
         }
-        int maxtransfer = 2*PAGE_SIZE - (dest & (PAGE_SIZE-1));
-        int transfer = dataend - dest;
-        if (transfer > maxtransfer)
-            transfer = ALIGN_DOWN(maxtransfer, maxpacket);
-        td->hwINFO = (dir ? TD_DP_IN : TD_DP_OUT) | toggle | TD_CC;
-        td->hwCBP = dest;
-        td->hwNextTD = (u32)&td[1];
-        td->hwBE = dest + transfer - 1;
-        td++;
-        dest += transfer;
-    }
-    if (cmd) {
-        // Send status pid on control transfers
-        if (td >= &tds[STACKOTDS]) {
-            warn_noalloc();
-            return -1;
+        while (dest < dataend) {
+            // Send data pids
+            if (td >= &tds[STACKOTDS]) {
+                if (cmd) {
+                    warn_noalloc();
+                    return -1;
+                }
+                break;
+            }
+            int maxtransfer = 2*PAGE_SIZE - (dest & (PAGE_SIZE-1));
+            int transfer = dataend - dest;
+            if (transfer > maxtransfer)
+                transfer = ALIGN_DOWN(maxtransfer, maxpacket);
+            td->hwINFO = (dir ? TD_DP_IN : TD_DP_OUT) | toggle | TD_CC;
+            td->hwCBP = dest;
+            td->hwNextTD = (u32)&td[1];
+            td->hwBE = dest + transfer - 1;
+            td++;
+            dest += transfer;
+        }
+        if (cmd) {
+            // Send status pid on control transfers
+            if (td >= &tds[STACKOTDS]) {
+                warn_noalloc();
+                return -1;
+            }
+            td->hwINFO = (dir ? TD_DP_OUT : TD_DP_IN) | TD_T_DATA1 | TD_CC;
+            td->hwCBP = 0;
+            td->hwNextTD = (u32)&td[1];
+            td->hwBE = 0;
+            td++;
         }
-        td->hwINFO = (dir ? TD_DP_OUT : TD_DP_IN) | TD_T_DATA1 | TD_CC;
-        td->hwCBP = 0;
-        td->hwNextTD = (u32)&td[1];
-        td->hwBE = 0;
-        td++;
-    }
 
-    // Transfer data
-    pipe->ed.hwHeadP = (u32)tds | (pipe->ed.hwHeadP & ED_C);
-    pipe->ed.hwTailP = (u32)td;
-    barrier();
-    pipe->ed.hwINFO &= ~ED_SKIP;
-    writel(&pipe->regs->cmdstatus, statuscmd);
+        // Transfer data
+        pipe->ed.hwHeadP = (u32)tds | (pipe->ed.hwHeadP & ED_C);
+        pipe->ed.hwTailP = (u32)td;
+        barrier();
+        pipe->ed.hwINFO &= ~ED_SKIP;
+        writel(&pipe->regs->cmdstatus, statuscmd);
+
+        int ret = wait_ed(&pipe->ed, usb_xfer_time(p, dest - start));
+        pipe->ed.hwINFO |= ED_SKIP;
+        if (ret) {
+            ohci_waittick(pipe->regs);
+            return ret;
+        }
+        if (dest >= dataend)
+            return 0;
+    }
+}
 
-    int ret = wait_ed(&pipe->ed, usb_xfer_time(p, datasize));
-    pipe->ed.hwINFO |= ED_SKIP;
-    if (ret)
-        ohci_waittick(pipe->regs);
-    return ret;
+// Restart the data toggle (and clear any halt) after the device
+// endpoint was reset.
+int
+ohci_reset_endpoint(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_OHCI)
+        return -1;
+    struct ohci_pipe *pipe = container_of(p, struct ohci_pipe, pipe);
+    u32 head = GET_LOWFLAT(pipe->ed.hwHeadP);
+    SET_LOWFLAT(pipe->ed.hwHeadP, head & ~(ED_C|ED_H));
+    return 0;
 }
 
 int
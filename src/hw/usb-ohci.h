@@ -12,6 +12,7 @@ struct usb_pipe *ohci_realloc_pipe(struct usbdevice_s *usbdev
 int ohci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
 int ohci_poll_intr(struct usb_pipe *p, void *data);
+int ohci_reset_endpoint(struct usb_pipe *p);
 
 
 /****************************************************************
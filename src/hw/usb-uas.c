@@ -1,10 +1,8 @@
 // Code for handling usb attached scsi devices.
 //
-// only usb 2.0 for now.
-//
-// once we have xhci driver with usb 3.0 support this must
-// be updated to use usb3 streams so booting from usb3
-// devices actually works.
+// usb 2.0 devices use the sequential READ_READY / WRITE_READY
+// protocol.  usb 3.0 devices use bulk streams, with the stream id
+// matching the command tag, which allows several commands in flight.
 //
 // Authors:
 //  Gerd Hoffmann <kraxel@redhat.com>
@@ -16,6 +14,7 @@
 
 #include "biosvar.h" // GET_GLOBALFLAT
 #include "block.h" // DTYPE_USB
+#include "byteorder.h" // cpu_to_be16
 #include "blockcmd.h" // cdb_read
 #include "config.h" // CONFIG_USB_UAS
 #include "malloc.h" // free
@@ -38,6 +37,9 @@
 #define UAS_PIPE_ID_DATA_IN         0x03
 #define UAS_PIPE_ID_DATA_OUT        0x04
 
+#define UAS_MAX_TAGS                4   // commands in flight on usb3 streams
+#define UAS_MIN_TAG_BLOCKS          8   // don't split reads below this size
+
 typedef struct {
     u8    id;
     u8    reserved;
@@ -91,6 +93,99 @@ struct uasdrive_s {
     u32 lun;
 };
 
+// Process a request on a usb3 device using streams.  Large reads are
+// split into several tagged commands which are all queued before
+// waiting for any of them to complete.
+static int
+uas_process_streams(struct disk_op_s *op, struct uasdrive_s *drive)
+{
+    uas_ui cmd, sts[UAS_MAX_TAGS];
+    int datalen[UAS_MAX_TAGS];
+    int blocksize = scsi_fill_cmd(op, cmd.command.cdb, sizeof(cmd.command.cdb));
+    if (blocksize < 0)
+        return default_process_op(op);
+    struct usb_pipe *data = scsi_is_read(op) ? drive->data_in : drive->data_out;
+
+    int tags = 1;
+    if (op->command == CMD_READ && op->count > UAS_MIN_TAG_BLOCKS) {
+        tags = DIV_ROUND_UP(op->count, UAS_MIN_TAG_BLOCKS);
+        if (tags > UAS_MAX_TAGS)
+            tags = UAS_MAX_TAGS;
+        if (tags > drive->status->streams)
+            tags = drive->status->streams;
+        if (tags > data->streams)
+            tags = data->streams;
+    }
+    u16 per = DIV_ROUND_UP(op->count, tags);
+
+    // Queue status and data transfers for each tag, then send the command.
+    int ret = 0, queued, i;
+    for (queued=0; queued<tags; queued++) {
+        u16 tag = queued + 1, done = queued * per;
+        struct disk_op_s chunk;
+        memcpy(&chunk, op, sizeof(chunk));
+        if (tags > 1) {
+            chunk.lba += done;
+            chunk.count = op->count - done < per ? op->count - done : per;
+            chunk.buf_fl += done * blocksize;
+        }
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.hdr.id = UAS_UI_COMMAND;
+        cmd.hdr.tag = cpu_to_be16(tag);
+        cmd.command.lun[1] = drive->lun;
+        scsi_fill_cmd(&chunk, cmd.command.cdb, sizeof(cmd.command.cdb));
+        datalen[queued] = chunk.count * blocksize;
+
+        memset(&sts[queued], 0xff, sizeof(sts[queued]));
+        ret = usb_send_stream(drive->status, tag, &sts[queued]
+                              , sizeof(sts[queued]));
+        if (!ret && datalen[queued])
+            ret = usb_send_stream(data, tag, chunk.buf_fl, datalen[queued]);
+        if (!ret)
+            ret = usb_send_bulk(drive->command, USB_DIR_OUT, &cmd
+                                , sizeof(cmd.hdr) + sizeof(cmd.command));
+        if (ret) {
+            dprintf(1, "uas: tag %d submit fail\n", tag);
+            break;
+        }
+    }
+
+    // Collect the status (and then the data) of every queued command.
+    for (i=0; i<queued; i++) {
+        u16 tag = i + 1;
+        if (usb_wait_stream(drive->status, tag, sizeof(sts[i]))) {
+            dprintf(1, "uas: tag %d status recv fail\n", tag);
+            ret = -1;
+            continue;
+        }
+        if (sts[i].hdr.id != UAS_UI_SENSE
+            || sts[i].hdr.tag != cpu_to_be16(tag)) {
+            dprintf(1, "uas: tag %d unexpected ui id %d\n", tag, sts[i].hdr.id);
+            ret = -1;
+            continue;
+        }
+        if (sts[i].sense.status) {
+            ret = -1;
+            continue;
+        }
+        if (datalen[i] && usb_wait_stream(data, tag, datalen[i])) {
+            dprintf(1, "uas: tag %d data xfer fail\n", tag);
+            ret = -1;
+        }
+    }
+
+    if (ret) {
+        // Don't leave transfers queued that point into this stack frame
+        // or the caller's buffer - the next command reuses the tags.
+        int used = queued < tags ? queued + 1 : tags;
+        for (i=0; i<used; i++) {
+            usb_cancel_stream(drive->status, i + 1);
+            usb_cancel_stream(data, i + 1);
+        }
+    }
+    return ret ? DISK_RET_EBADTRACK : DISK_RET_SUCCESS;
+}
+
 int
 uas_process_op(struct disk_op_s *op)
 {
@@ -99,6 +194,8 @@ uas_process_op(struct disk_op_s *op)
 
     struct uasdrive_s *drive_gf = container_of(
         op->drive_fl, struct uasdrive_s, drive);
+    if (!MODESEGMENT && drive_gf->status->streams)
+        return uas_process_streams(op, drive_gf);
 
     uas_ui ui;
     memset(&ui, 0, sizeof(ui));
@@ -212,6 +309,30 @@ uas_add_lun(u32 lun, struct drive_s *tmpl_drv)
     return 0;
 }
 
+// Allocate a status or data pipe, with streams on usb3 devices
+static struct usb_pipe *
+uas_alloc_pipe(struct usbdevice_s *usbdev, struct usb_endpoint_descriptor *ep
+               , struct usb_ss_ep_comp_descriptor *comp)
+{
+    if (!comp)
+        return usb_alloc_pipe(usbdev, ep);
+    int maxstreams = comp->bmAttributes & USB_SS_EP_COMP_STREAMS_MASK;
+    if (!maxstreams) {
+        dprintf(1, "uas: superspeed endpoint without streams\n");
+        return NULL;
+    }
+    int streams = 1 << maxstreams;
+    if (streams > UAS_MAX_TAGS)
+        streams = UAS_MAX_TAGS;
+    struct usb_pipe *pipe = usb_alloc_stream_pipe(usbdev, ep, streams);
+    if (pipe && !pipe->streams) {
+        dprintf(1, "uas: controller has no usb3 stream support\n");
+        usb_free_pipe(usbdev, pipe);
+        return NULL;
+    }
+    return pipe;
+}
+
 int
 usb_uas_setup(struct usbdevice_s *usbdev)
 {
@@ -229,6 +350,7 @@ usb_uas_setup(struct usbdevice_s *usbdev)
 
     /* find & allocate pipes */
     struct usb_endpoint_descriptor *ep = NULL;
+    struct usb_ss_ep_comp_descriptor *comp = NULL;
     struct usb_pipe *command = NULL;
     struct usb_pipe *status = NULL;
     struct usb_pipe *data_in = NULL;
@@ -239,24 +361,24 @@ usb_uas_setup(struct usbdevice_s *usbdev)
         switch (desc[1]) {
         case USB_DT_ENDPOINT:
             ep = (void*)desc;
+            comp = NULL;
             break;
         case USB_DT_ENDPOINT_COMPANION:
-            /* No support (yet) for usb3 streams */
-            dprintf(1, "Superspeed UAS devices not supported (yet)\n");
-            goto fail;
+            comp = (void*)desc;
+            break;
         case 0x24:
             switch (desc[2]) {
             case UAS_PIPE_ID_COMMAND:
                 command = usb_alloc_pipe(usbdev, ep);
                 break;
             case UAS_PIPE_ID_STATUS:
-                status = usb_alloc_pipe(usbdev, ep);
+                status = uas_alloc_pipe(usbdev, ep, comp);
                 break;
             case UAS_PIPE_ID_DATA_IN:
-                data_in = usb_alloc_pipe(usbdev, ep);
+                data_in = uas_alloc_pipe(usbdev, ep, comp);
                 break;
             case UAS_PIPE_ID_DATA_OUT:
-                data_out = usb_alloc_pipe(usbdev, ep);
+                data_out = uas_alloc_pipe(usbdev, ep, comp);
                 break;
             default:
                 goto fail;
@@ -381,7 +381,7 @@ uhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     // Allocate a new queue head.
     struct uhci_pipe *pipe;
     if (eptype == USB_ENDPOINT_XFER_CONTROL)
-        pipe = malloc_tmphigh(sizeof(*pipe));
+        pipe = malloc_high(sizeof(*pipe));
     else
         pipe = malloc_low(sizeof(*pipe));
     if (!pipe) {
@@ -539,6 +539,17 @@ fail:
     return -1;
 }
 
+// Restart the data toggle after the device endpoint was reset.
+int
+uhci_reset_endpoint(struct usb_pipe *p)
+{
+    if (! CONFIG_USB_UHCI)
+        return -1;
+    struct uhci_pipe *pipe = container_of(p, struct uhci_pipe, pipe);
+    SET_LOWFLAT(pipe->toggle, 0);
+    return 0;
+}
+
 int
 uhci_poll_intr(struct usb_pipe *p, void *data)
 {
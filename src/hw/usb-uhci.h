@@ -12,6 +12,7 @@ struct usb_pipe *uhci_realloc_pipe(struct usbdevice_s *usbdev
 int uhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
 int uhci_poll_intr(struct usb_pipe *p, void *data);
+int uhci_reset_endpoint(struct usb_pipe *p);
 
 
 /****************************************************************
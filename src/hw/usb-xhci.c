@@ -5,13 +5,16 @@
 //
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
+#include "biosvar.h" // SET_IVT
 #include "config.h" // CONFIG_*
 #include "malloc.h" // memalign_low
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
+#include "pci.h" // pci_find_capability
 #include "pcidevice.h" // foreachpci
 #include "pci_ids.h" // PCI_CLASS_SERIAL_USB_XHCI
 #include "pci_regs.h" // PCI_BASE_ADDRESS_0
+#include "stacks.h" // yield_toirq
 #include "string.h" // memcpy
 #include "usb.h" // struct usb_s
 #include "usb-xhci.h" // struct ehci_qh
@@ -24,6 +27,18 @@
 #define XHCI_RING_ITEMS          16
 #define XHCI_RING_SIZE           (XHCI_RING_ITEMS*sizeof(struct xhci_trb))
 
+// A TRB buffer may not cross a 64KiB boundary.
+#define XHCI_TRB_MAX_XFER        (64*1024)
+// Longest TD (in TRBs) queued at once; leaves room for a link TRB.
+#define XHCI_TD_MAX_TRBS         (XHCI_RING_ITEMS - 2)
+// Largest transfer that always fits in one TD regardless of alignment.
+#define XHCI_TD_MAX_XFER         ((XHCI_TD_MAX_TRBS - 1) * XHCI_TRB_MAX_XFER)
+
+// Interrupt vector used for event ring MSIs (CONFIG_USB_XHCI_MSI)
+#define XHCI_MSI_VECTOR          0xfa
+// Minimum interval between event ring interrupts (250ns units)
+#define XHCI_MSI_IMOD            4000
+
 /*
  *  xhci_ring structs are allocated with XHCI_RING_SIZE alignment,
  *  then we can get it from a trb pointer (provided by evt ring).
@@ -54,6 +69,11 @@
 #define XHCI_STS_CNR             (1<<11)
 #define XHCI_STS_HCE             (1<<12)
 
+#define XHCI_IMAN_IP             (1<<0)
+#define XHCI_IMAN_IE             (1<<1)
+
+#define XHCI_ERDP_EHB            (1<<3)
+
 #define XHCI_PORTSC_CCS          (1<<0)
 #define XHCI_PORTSC_PED          (1<<1)
 #define XHCI_PORTSC_OCA          (1<<3)
@@ -239,6 +259,8 @@ struct usb_xhci_s {
     u32                  ports;
     u32                  slots;
     u8                   context64;
+    u8                   maxpsa;
+    u8                   msi;
     struct xhci_portmap  usb2;
     struct xhci_portmap  usb3;
 
@@ -254,6 +276,8 @@ struct usb_xhci_s {
     struct xhci_ring     *cmds;
     struct xhci_ring     *evts;
     struct xhci_er_seg   *eseg;
+    struct xhci_inctx    *rstctx; // input context for runtime ep resets
+    struct mutex_s       rstlock;
 };
 
 struct xhci_pipe {
@@ -264,6 +288,10 @@ struct xhci_pipe {
     u32                  epid;
     void                 *buf;
     int                  bufused;
+
+    /* usb3 bulk streams (stream id N uses streams[N-1]) */
+    struct xhci_streamctx *sctx;
+    struct xhci_ring     **streams;
 };
 
 // --------------------------------------------------------------
@@ -438,6 +466,66 @@ xhci_free_pipes(struct usb_xhci_s *xhci)
     // XXX - should walk list of pipes and free unused pipes.
 }
 
+#define APIC_ID      ((u8*)BUILD_APIC_ADDR + 0x020)
+#define APIC_EOI     ((u8*)BUILD_APIC_ADDR + 0x0B0)
+#define APIC_SVR     ((u8*)BUILD_APIC_ADDR + 0x0F0)
+#define APIC_ENABLED 0x0100
+#define MSR_IA32_APIC_BASE 0x01B
+#define MSR_IA32_APICBASE_ENABLE (1ULL << 11)
+#define MSR_IA32_APICBASE_EXTD   (1ULL << 10)
+
+// Acknowledge an event ring MSI at the local apic
+void VISIBLE32FLAT
+xhci_msi_eoi(void)
+{
+    writel(APIC_EOI, 0);
+}
+
+// Deliver event ring interrupts to the boot cpu via MSI
+static void
+xhci_msi_setup(struct usb_xhci_s *xhci)
+{
+    if (!CONFIG_USB_XHCI_MSI)
+        return;
+    u16 bdf = xhci->usb.pci->bdf;
+    u8 cap = pci_find_capability(bdf, PCI_CAP_ID_MSI, 0);
+    if (!cap) {
+        dprintf(1, "XHCI no MSI capability - polling events\n");
+        return;
+    }
+    u32 eax, ebx, ecx, cpuid_features;
+    cpuid(1, &eax, &ebx, &ecx, &cpuid_features);
+    if (!(cpuid_features & CPUID_APIC))
+        return;
+    u64 apicbase = rdmsr(MSR_IA32_APIC_BASE);
+    if ((apicbase & (MSR_IA32_APICBASE_ENABLE | MSR_IA32_APICBASE_EXTD))
+        != MSR_IA32_APICBASE_ENABLE || !(readl(APIC_SVR) & APIC_ENABLED)) {
+        dprintf(1, "XHCI local apic not usable - polling events\n");
+        return;
+    }
+
+    u32 apicid = readl(APIC_ID) >> 24;
+    u16 flags = pci_config_readw(bdf, cap + PCI_MSI_FLAGS);
+    pci_config_writel(bdf, cap + PCI_MSI_ADDRESS_LO
+                      , BUILD_APIC_ADDR | (apicid << 12));
+    if (flags & PCI_MSI_FLAGS_64BIT) {
+        pci_config_writel(bdf, cap + PCI_MSI_ADDRESS_HI, 0);
+        pci_config_writew(bdf, cap + PCI_MSI_DATA_64, XHCI_MSI_VECTOR);
+    } else {
+        pci_config_writew(bdf, cap + PCI_MSI_DATA_32, XHCI_MSI_VECTOR);
+    }
+    SET_IVT(XHCI_MSI_VECTOR, FUNC16(entry_xhci_msi));
+    pci_config_writew(bdf, cap + PCI_MSI_FLAGS
+                      , (flags & ~PCI_MSI_FLAGS_QSIZE) | PCI_MSI_FLAGS_ENABLE);
+
+    writel(&xhci->ir->imod, XHCI_MSI_IMOD);
+    writel(&xhci->ir->iman, XHCI_IMAN_IE | XHCI_IMAN_IP);
+    writel(&xhci->op->usbcmd, readl(&xhci->op->usbcmd) | XHCI_CMD_INTE);
+    xhci->msi = 1;
+    dprintf(1, "XHCI using MSI vector 0x%x (apic %d)\n"
+            , XHCI_MSI_VECTOR, apicid);
+}
+
 static void
 configure_xhci(void *data)
 {
@@ -508,6 +596,8 @@ configure_xhci(void *data)
         xhci->devs[0].ptr_high = 0;
     }
 
+    xhci_msi_setup(xhci);
+
     reg = readl(&xhci->op->usbcmd);
     reg |= XHCI_CMD_RS;
     writel(&xhci->op->usbcmd, reg);
@@ -515,9 +605,12 @@ configure_xhci(void *data)
     // Find devices
     int count = xhci_check_ports(xhci);
     xhci_free_pipes(xhci);
-    if (count)
+    if (count) {
         // Success
+        xhci->rstctx = memalign_high(
+            64, (sizeof(struct xhci_inctx) * 33) << xhci->context64);
         return;
+    }
 
     // No devices found - shutdown and free controller.
     dprintf(1, "XHCI no devices found\n");
@@ -559,14 +652,16 @@ xhci_controller_setup(struct pci_device *pci)
     xhci->slots = hcs1         & 0xff;
     xhci->xcap  = ((hcc >> 16) & 0xffff) << 2;
     xhci->context64 = (hcc & 0x04) ? 1 : 0;
+    xhci->maxpsa = (hcc >> 12) & 0x0f;
 
     xhci->usb.pci = pci;
     xhci->usb.type = USB_TYPE_XHCI;
 
     dprintf(1, "XHCI init on dev %pP: regs @ %p, %d ports, %d slots"
-            ", %d byte contexts\n"
+            ", %d byte contexts, %d streams\n"
             , pci, xhci->caps, xhci->ports, xhci->slots
-            , xhci->context64 ? 64 : 32);
+            , xhci->context64 ? 64 : 32
+            , xhci->maxpsa ? (2 << xhci->maxpsa) - 1 : 0);
 
     if (xhci->xcap) {
         u32 off;
@@ -674,6 +769,15 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
             struct xhci_trb  *rtrb = (void*)etrb->ptr_low;
             struct xhci_ring *ring = XHCI_RING(rtrb);
             struct xhci_trb  *evt = &ring->evt;
+            if (evt_cc == CC_SHORT_PACKET) {
+                // A short packet ends the TD early - skip to its last TRB.
+                while (rtrb->control & TRB_TR_CH) {
+                    if (TRB_TYPE(rtrb->control) == TR_LINK)
+                        rtrb = ring->ring;
+                    else
+                        rtrb++;
+                }
+            }
             u32 eidx = rtrb - ring->ring + 1;
             dprintf(5, "%s: ring %p [trb %p, evt %p, type %d, eidx %d, cc %d]\n",
                     __func__, ring, rtrb, evt, evt_type, eidx, evt_cc);
@@ -710,6 +814,10 @@ static void xhci_process_events(struct usb_xhci_s *xhci)
         evts->nidx = nidx;
         struct xhci_ir *ir = xhci->ir;
         u32 erdp = (u32)(evts->ring + nidx);
+        if (CONFIG_USB_XHCI_MSI && xhci->msi)
+            // Clear the event handler busy flag so the next event
+            // raises another interrupt.
+            erdp |= XHCI_ERDP_EHB;
         writel(&ir->erdp_low, erdp);
         writel(&ir->erdp_high, 0);
     }
@@ -740,7 +848,10 @@ static int xhci_event_wait(struct usb_xhci_s *xhci,
             warn_timeout();
             return -1;
         }
-        yield();
+        if (CONFIG_USB_XHCI_MSI && xhci->msi)
+            yield_toirq();
+        else
+            yield();
     }
 }
 
@@ -764,7 +875,10 @@ static void xhci_trb_queue(struct xhci_ring *ring,
                            void *data, u32 xferlen, u32 flags)
 {
     if (ring->nidx >= ARRAY_SIZE(ring->ring) - 1) {
-        xhci_trb_fill(ring, ring->ring, 0, (TR_LINK << 10) | TRB_LK_TC);
+        // Keep the chain bit if the link is in the middle of a TD.
+        u32 chain = ring->ring[ring->nidx - 1].control & TRB_TR_CH;
+        xhci_trb_fill(ring, ring->ring, 0
+                      , (TR_LINK << 10) | TRB_LK_TC | chain);
         ring->nidx = 0;
         ring->cs ^= 1;
         dprintf(5, "%s: ring %p [linked]\n", __func__, ring);
@@ -776,6 +890,18 @@ static void xhci_trb_queue(struct xhci_ring *ring,
             __func__, ring, ring->nidx, xferlen);
 }
 
+// Queue a command TRB on the xhci controller ring and wait for it
+static int xhci_cmd_queue(struct usb_xhci_s *xhci, void *ptr, u32 status
+                          , u32 flags)
+{
+    mutex_lock(&xhci->cmds->lock);
+    xhci_trb_queue(xhci->cmds, ptr, status, flags);
+    xhci_doorbell(xhci, 0, 0);
+    int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
+    mutex_unlock(&xhci->cmds->lock);
+    return rc;
+}
+
 // Submit a command to the xhci controller ring
 static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
                            , u32 flags)
@@ -791,12 +917,7 @@ static int xhci_cmd_submit(struct usb_xhci_s *xhci, struct xhci_inctx *inctx
         }
     }
 
-    mutex_lock(&xhci->cmds->lock);
-    xhci_trb_queue(xhci->cmds, inctx, 0, flags);
-    xhci_doorbell(xhci, 0, 0);
-    int rc = xhci_event_wait(xhci, xhci->cmds, 1000);
-    mutex_unlock(&xhci->cmds->lock);
-    return rc;
+    return xhci_cmd_queue(xhci, inctx, 0, flags);
 }
 
 static int xhci_cmd_enable_slot(struct usb_xhci_s *xhci)
@@ -831,6 +952,32 @@ static int xhci_cmd_configure_endpoint(struct usb_xhci_s *xhci, u32 slotid
                            , (CR_CONFIGURE_ENDPOINT << 10) | (slotid << 24));
 }
 
+static int xhci_cmd_reset_endpoint(struct usb_xhci_s *xhci, u32 slotid
+                                   , u32 epid)
+{
+    dprintf(3, "%s: slotid %d, epid %d\n", __func__, slotid, epid);
+    return xhci_cmd_submit(xhci, NULL, (CR_RESET_ENDPOINT << 10)
+                           | (slotid << 24) | (epid << 16));
+}
+
+static int xhci_cmd_stop_endpoint(struct usb_xhci_s *xhci, u32 slotid
+                                  , u32 epid)
+{
+    dprintf(3, "%s: slotid %d, epid %d\n", __func__, slotid, epid);
+    return xhci_cmd_submit(xhci, NULL, (CR_STOP_ENDPOINT << 10)
+                           | (slotid << 24) | (epid << 16));
+}
+
+static int xhci_cmd_set_dequeue(struct usb_xhci_s *xhci, u32 slotid
+                                , u32 epid, u16 stream, u32 deq)
+{
+    dprintf(3, "%s: slotid %d, epid %d, stream %d\n", __func__,
+            slotid, epid, stream);
+    return xhci_cmd_queue(xhci, (void*)deq, stream << 16
+                          , (CR_SET_TR_DEQUEUE << 10)
+                          | (slotid << 24) | (epid << 16));
+}
+
 static int xhci_cmd_evaluate_context(struct usb_xhci_s *xhci, u32 slotid
                                      , struct xhci_inctx *inctx)
 {
@@ -912,9 +1059,75 @@ static int xhci_config_hub(struct usbhub_s *hub)
     return 0;
 }
 
+// Free the stream context array and stream rings of a pipe
+static void
+xhci_free_streams(struct xhci_pipe *pipe)
+{
+    if (pipe->streams) {
+        int i;
+        for (i=0; i<pipe->pipe.streams; i++)
+            free(pipe->streams[i]);
+    }
+    free(pipe->streams);
+    free(pipe->sctx);
+    pipe->streams = NULL;
+    pipe->sctx = NULL;
+    pipe->pipe.streams = 0;
+}
+
+// Allocate a primary stream context array with one transfer ring per
+// stream and point the endpoint context at it.
+static int
+xhci_alloc_streams(struct usb_xhci_s *xhci, struct xhci_pipe *pipe
+                   , struct xhci_epctx *ep, int streams)
+{
+    // Stream id 0 is reserved, so an array of 2^(pstreams+1) entries
+    // provides 2^(pstreams+1)-1 usable streams.
+    int pstreams = 1;
+    while ((2 << pstreams) - 1 < streams && pstreams < xhci->maxpsa)
+        pstreams++;
+    if (streams > (2 << pstreams) - 1)
+        streams = (2 << pstreams) - 1;
+
+    int size = sizeof(*pipe->sctx) << (pstreams + 1);
+    pipe->sctx = memalign_high(64, size);
+    pipe->streams = malloc_high(sizeof(*pipe->streams) * streams);
+    if (!pipe->sctx || !pipe->streams)
+        goto fail;
+    memset(pipe->sctx, 0, size);
+    memset(pipe->streams, 0, sizeof(*pipe->streams) * streams);
+    int i;
+    for (i=0; i<streams; i++) {
+        struct xhci_ring *ring = memalign_high(XHCI_RING_SIZE, sizeof(*ring));
+        if (!ring)
+            goto fail;
+        memset(ring, 0, sizeof(*ring));
+        ring->cs = 1;
+        pipe->streams[i] = ring;
+        pipe->pipe.streams = i + 1;
+        pipe->sctx[i+1].deq_low = (u32)&ring->ring[0];
+        pipe->sctx[i+1].deq_low |= (1 << 1) | 1; // primary ring, dcs
+    }
+
+    ep->ctx[0]  |= pstreams << 10;  // MaxPStreams
+    ep->ctx[0]  |= 1 << 15;         // linear stream array
+    ep->deq_low  = (u32)pipe->sctx;
+    dprintf(3, "%s: epid %d, %d streams, sctx %p\n", __func__,
+            pipe->epid, streams, pipe->sctx);
+    return 0;
+
+fail:
+    warn_noalloc();
+    xhci_free_streams(pipe);
+    return -1;
+}
+
+static void xhci_xfer_normal(struct xhci_pipe *pipe,
+                             void *data, int datalen);
+
 static struct usb_pipe *
 xhci_alloc_pipe(struct usbdevice_s *usbdev
-                , struct usb_endpoint_descriptor *epdesc)
+                , struct usb_endpoint_descriptor *epdesc, int streams)
 {
     u8 eptype = epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
     struct usb_xhci_s *xhci = container_of(
@@ -967,6 +1180,12 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
     ep->deq_low  = (u32)&pipe->reqs.ring[0];
     ep->deq_low  |= 1;         // dcs
     ep->length   = pipe->pipe.maxpacket;
+    if (streams && eptype == USB_ENDPOINT_XFER_BULK
+        && usbdev->speed == USB_SUPERSPEED && xhci->maxpsa) {
+        int ret = xhci_alloc_streams(xhci, pipe, ep, streams);
+        if (ret)
+            goto fail;
+    }
 
     dprintf(3, "%s: usbdev %p, ring %p, slotid %d, epid %d\n", __func__,
             usbdev, &pipe->reqs, pipe->slotid, pipe->epid);
@@ -1021,9 +1240,16 @@ xhci_alloc_pipe(struct usbdevice_s *usbdev
         }
     }
     free(in);
+    if (eptype == USB_ENDPOINT_XFER_INT) {
+        // Keep a transfer queued so a completion can raise an interrupt.
+        xhci_xfer_normal(pipe, pipe->buf, pipe->pipe.maxpacket);
+        pipe->bufused = 1;
+        pipe->pipe.irqdriven = xhci->msi;
+    }
     return &pipe->pipe;
 
 fail:
+    xhci_free_streams(pipe);
     free(pipe->buf);
     free(pipe);
     free(in);
@@ -1041,7 +1267,7 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
         return NULL;
     }
     if (!upipe)
-        return xhci_alloc_pipe(usbdev, epdesc);
+        return xhci_alloc_pipe(usbdev, epdesc, 0);
     u8 eptype = epdesc->bmAttributes & USB_ENDPOINT_XFERTYPE_MASK;
     int oldmaxpacket = upipe->maxpacket;
     usb_desc2pipe(upipe, usbdev, epdesc);
@@ -1072,6 +1298,17 @@ xhci_realloc_pipe(struct usbdevice_s *usbdev, struct usb_pipe *upipe
     return upipe;
 }
 
+// Allocate a bulk pipe with up to "streams" usb3 streams.  The pipe's
+// "streams" field holds the number actually available (possibly none).
+struct usb_pipe *
+xhci_alloc_stream_pipe(struct usbdevice_s *usbdev
+                       , struct usb_endpoint_descriptor *epdesc, int streams)
+{
+    if (!CONFIG_USB_XHCI)
+        return NULL;
+    return xhci_alloc_pipe(usbdev, epdesc, streams);
+}
+
 // Submit a USB "setup" message request to the pipe's ring
 static void xhci_xfer_setup(struct xhci_pipe *pipe, int dir, void *cmd
                             , void *data, int datalen)
@@ -1089,13 +1326,37 @@ static void xhci_xfer_setup(struct xhci_pipe *pipe, int dir, void *cmd
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
+// Queue a TD for a transfer of up to XHCI_TD_MAX_XFER bytes.  The
+// buffer is split into chained TRBs at 64KiB boundaries and only the
+// last TRB raises a completion event.
+static void xhci_td_queue(struct xhci_ring *ring, int maxpacket,
+                          void *data, u32 datalen)
+{
+    u32 pos = (u32)data, end = pos + datalen;
+    for (;;) {
+        u32 next = ALIGN_DOWN(pos, XHCI_TRB_MAX_XFER) + XHCI_TRB_MAX_XFER;
+        if (next >= end) {
+            xhci_trb_queue(ring, (void*)pos, end - pos
+                           , (TR_NORMAL << 10) | TRB_TR_IOC);
+            return;
+        }
+        // The TD size field holds the packets left after this TRB.
+        u32 tdsize = DIV_ROUND_UP(end - next, maxpacket);
+        if (tdsize > 31)
+            tdsize = 31;
+        xhci_trb_queue(ring, (void*)pos, (next - pos) | (tdsize << 17)
+                       , (TR_NORMAL << 10) | TRB_TR_CH | TRB_TR_ISP);
+        pos = next;
+    }
+}
+
 // Submit a USB transfer request to the pipe's ring
 static void xhci_xfer_normal(struct xhci_pipe *pipe,
                              void *data, int datalen)
 {
     struct usb_xhci_s *xhci = container_of(
         pipe->pipe.cntl, struct usb_xhci_s, usb);
-    xhci_trb_queue(&pipe->reqs, data, datalen, (TR_NORMAL << 10) | TRB_TR_IOC);
+    xhci_td_queue(&pipe->reqs, pipe->pipe.maxpacket, data, datalen);
     xhci_doorbell(xhci, pipe->slotid, pipe->epid);
 }
 
@@ -1115,16 +1376,181 @@ xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
             // Set address command sent during xhci_alloc_pipe.
             return 0;
         xhci_xfer_setup(pipe, dir, (void*)req, data, datalen);
+        int cc = xhci_event_wait(xhci, &pipe->reqs, usb_xfer_time(p, datalen));
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+            return -1;
+        }
+        return 0;
+    }
+
+    // Bulk transfers go out as few chained TDs as the ring allows.
+    for (;;) {
+        int count = datalen < XHCI_TD_MAX_XFER ? datalen : XHCI_TD_MAX_XFER;
+        xhci_xfer_normal(pipe, data, count);
+        int cc = xhci_event_wait(xhci, &pipe->reqs, usb_xfer_time(p, count));
+        if (cc != CC_SUCCESS) {
+            dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+            return -1;
+        }
+        data += count;
+        datalen -= count;
+        if (datalen <= 0)
+            return 0;
+    }
+}
+
+// Queue a transfer on one stream of a bulk pipe without waiting for it
+int
+xhci_send_stream(struct usb_pipe *p, u16 stream, void *data, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams || datalen > XHCI_TD_MAX_XFER)
+        return -1;
+
+    xhci_td_queue(pipe->streams[stream-1], pipe->pipe.maxpacket
+                  , data, datalen);
+    xhci_doorbell(xhci, pipe->slotid, pipe->epid | (stream << 16));
+    return 0;
+}
+
+// Wait for the transfers queued on a stream to complete
+int
+xhci_wait_stream(struct usb_pipe *p, u16 stream, int datalen)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams)
+        return -1;
+
+    int cc = xhci_event_wait(xhci, pipe->streams[stream-1]
+                             , usb_xfer_time(p, datalen));
+    if (cc != CC_SUCCESS && cc != CC_SHORT_PACKET) {
+        dprintf(1, "%s: stream %d xfer failed (cc %d)\n", __func__, stream, cc);
+        return -1;
+    }
+    return 0;
+}
+
+// Discard any TRBs still queued on a ring.  Returns the ring's new
+// dequeue pointer (with the dequeue cycle state bit).
+static u32
+xhci_ring_flush(struct xhci_ring *ring)
+{
+    ring->eidx = ring->nidx;
+    return (u32)&ring->ring[ring->nidx] | (ring->cs ? 1 : 0);
+}
+
+// Reset the controller side of an endpoint after the device endpoint
+// was reset.  The endpoint is dropped and added back, which restarts
+// its sequence number (data toggle) and its rings at an empty state.
+int
+xhci_reset_endpoint(struct usb_pipe *p)
+{
+    ASSERT32FLAT();
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    struct xhci_slotctx *dev = (void*)xhci->devs[pipe->slotid].ptr_low;
+    struct xhci_epctx *outep = (void*)&dev[pipe->epid << xhci->context64];
+
+    int cc = CC_SUCCESS;
+    switch (outep->ctx[0] & 0x7) {
+    case 1: // running
+        cc = xhci_cmd_stop_endpoint(xhci, pipe->slotid, pipe->epid);
+        break;
+    case 2: // halted
+        cc = xhci_cmd_reset_endpoint(xhci, pipe->slotid, pipe->epid);
+        break;
+    }
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: stop endpoint: failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+
+    struct xhci_inctx *in = xhci->rstctx;
+    if (!in)
+        return -1;
+    mutex_lock(&xhci->rstlock);
+    memset(in, 0, (sizeof(struct xhci_inctx) * 33) << xhci->context64);
+    in->del = 1 << pipe->epid;
+    in->add = 0x01 | (1 << pipe->epid);
+    memcpy(&in[1 << xhci->context64], dev, sizeof(*dev));
+    struct xhci_epctx *ep = (void*)&in[(pipe->epid+1) << xhci->context64];
+    memcpy(ep, outep, sizeof(*ep));
+    ep->ctx[0] &= ~0x7;
+    if (pipe->pipe.streams) {
+        int i;
+        for (i=0; i<pipe->pipe.streams; i++)
+            pipe->sctx[i+1].deq_low = (xhci_ring_flush(pipe->streams[i])
+                                       | (1 << 1)); // primary ring
     } else {
-        xhci_xfer_normal(pipe, data, datalen);
+        ep->deq_low = xhci_ring_flush(&pipe->reqs);
+        ep->deq_high = 0;
     }
+    cc = xhci_cmd_configure_endpoint(xhci, pipe->slotid, in);
+    mutex_unlock(&xhci->rstlock);
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: configure endpoint: failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+    pipe->bufused = 0;
+    return 0;
+}
+
+// Discard the transfers still queued on a stream of a bulk pipe (for
+// example after a failed command).  A running endpoint keeps its
+// sequence number; a halted one has to be reset to be restarted.
+int
+xhci_cancel_stream(struct usb_pipe *p, u16 stream)
+{
+    if (!CONFIG_USB_XHCI)
+        return -1;
+    struct xhci_pipe *pipe = container_of(p, struct xhci_pipe, pipe);
+    struct usb_xhci_s *xhci = container_of(
+        pipe->pipe.cntl, struct usb_xhci_s, usb);
+    if (!stream || stream > pipe->pipe.streams)
+        return -1;
+    struct xhci_ring *ring = pipe->streams[stream-1];
+    if (!xhci_ring_busy(ring))
+        return 0;
 
-    int cc = xhci_event_wait(xhci, &pipe->reqs, usb_xfer_time(p, datalen));
+    struct xhci_slotctx *dev = (void*)xhci->devs[pipe->slotid].ptr_low;
+    struct xhci_epctx *outep = (void*)&dev[pipe->epid << xhci->context64];
+    int cc = CC_SUCCESS;
+    switch (outep->ctx[0] & 0x7) {
+    case 1: // running
+        cc = xhci_cmd_stop_endpoint(xhci, pipe->slotid, pipe->epid);
+        break;
+    case 2: // halted
+        cc = xhci_cmd_reset_endpoint(xhci, pipe->slotid, pipe->epid);
+        break;
+    }
+    if (cc != CC_SUCCESS) {
+        dprintf(1, "%s: stop endpoint: failed (cc %d)\n", __func__, cc);
+        return -1;
+    }
+    cc = xhci_cmd_set_dequeue(xhci, pipe->slotid, pipe->epid, stream
+                              , xhci_ring_flush(ring) | (1 << 1));
     if (cc != CC_SUCCESS) {
-        dprintf(1, "%s: xfer failed (cc %d)\n", __func__, cc);
+        dprintf(1, "%s: set dequeue: failed (cc %d)\n", __func__, cc);
         return -1;
     }
 
+    // Restart streams that still have transfers queued.
+    int i;
+    for (i=0; i<pipe->pipe.streams; i++)
+        if (xhci_ring_busy(pipe->streams[i]))
+            xhci_doorbell(xhci, pipe->slotid, pipe->epid | ((i+1) << 16));
     return 0;
 }
 
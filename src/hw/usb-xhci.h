@@ -12,9 +12,17 @@ void xhci_setup(void);
 struct usb_pipe *xhci_realloc_pipe(struct usbdevice_s *usbdev
                                    , struct usb_pipe *upipe
                                    , struct usb_endpoint_descriptor *epdesc);
+struct usb_pipe *xhci_alloc_stream_pipe(struct usbdevice_s *usbdev
+                                        , struct usb_endpoint_descriptor *epdesc
+                                        , int streams);
 int xhci_send_pipe(struct usb_pipe *p, int dir, const void *cmd
                    , void *data, int datasize);
+int xhci_send_stream(struct usb_pipe *p, u16 stream, void *data, int datalen);
+int xhci_wait_stream(struct usb_pipe *p, u16 stream, int datalen);
+int xhci_cancel_stream(struct usb_pipe *p, u16 stream);
 int xhci_poll_intr(struct usb_pipe *p, void *data);
+int xhci_reset_endpoint(struct usb_pipe *p);
+void xhci_msi_eoi(void);
 
 // --------------------------------------------------------------
 // register interface
@@ -101,6 +109,13 @@ struct xhci_epctx {
     u32 reserved_01[3];
 } PACKED;
 
+// stream context array element
+struct xhci_streamctx {
+    u32 deq_low;
+    u32 deq_high;
+    u32 reserved_01[2];
+} PACKED;
+
 // device context array element
 struct xhci_devlist {
     u32 ptr_low;
@@ -67,6 +67,19 @@ usb_send_pipe(struct usb_pipe *pipe_fl, int dir, const void *cmd
     }
 }
 
+// Count of xhci MSI interrupts (for interrupt driven polling)
+u8 UsbIrqCount VARLOW;
+
+// Handler for xhci event ring MSI interrupts.
+void VISIBLE16
+handle_xhci_msi(void)
+{
+    if (!CONFIG_USB_XHCI_MSI)
+        return;
+    SET_LOW(UsbIrqCount, GET_LOW(UsbIrqCount) + 1);
+    call32(xhci_msi_eoi, 0, 0);
+}
+
 int
 usb_poll_intr(struct usb_pipe *pipe_fl, void *data)
 {
@@ -80,11 +93,38 @@ usb_poll_intr(struct usb_pipe *pipe_fl, void *data)
     case USB_TYPE_EHCI:
         return ehci_poll_intr(pipe_fl, data);
     case USB_TYPE_XHCI: ;
+        if (CONFIG_USB_XHCI_MSI && GET_LOWFLAT(pipe_fl->irqdriven)) {
+            // Completions raise an MSI - only poll after one arrived.
+            u8 count = GET_LOW(UsbIrqCount);
+            if (GET_LOWFLAT(pipe_fl->irqseen) == count)
+                return -1;
+            SET_LOWFLAT(pipe_fl->irqseen, count);
+        }
         return call32_params(xhci_poll_intr, pipe_fl
                              , MAKE_FLATPTR(GET_SEG(SS), data), 0, -1);
     }
 }
 
+// Reset the controller's state for an endpoint (such as its data
+// toggle) after the device endpoint was reset with CLEAR_FEATURE.
+int
+usb_reset_pipe(struct usb_pipe *pipe_fl)
+{
+    switch (GET_LOWFLAT(pipe_fl->type)) {
+    default:
+    case USB_TYPE_UHCI:
+        return uhci_reset_endpoint(pipe_fl);
+    case USB_TYPE_OHCI:
+        return ohci_reset_endpoint(pipe_fl);
+    case USB_TYPE_EHCI:
+        return ehci_reset_endpoint(pipe_fl);
+    case USB_TYPE_XHCI:
+        if (MODESEGMENT)
+            return -1;
+        return xhci_reset_endpoint(pipe_fl);
+    }
+}
+
 int usb_32bit_pipe(struct usb_pipe *pipe_fl)
 {
     return (CONFIG_USB_XHCI && GET_LOWFLAT(pipe_fl->type) == USB_TYPE_XHCI)
@@ -104,6 +144,17 @@ usb_alloc_pipe(struct usbdevice_s *usbdev
     return usb_realloc_pipe(usbdev, NULL, epdesc);
 }
 
+// Allocate a bulk pipe with up to "streams" usb3 streams.  The
+// pipe's "streams" field is zero if the controller can't provide them.
+struct usb_pipe *
+usb_alloc_stream_pipe(struct usbdevice_s *usbdev
+                      , struct usb_endpoint_descriptor *epdesc, int streams)
+{
+    if (usbdev->hub->cntl->type == USB_TYPE_XHCI)
+        return xhci_alloc_stream_pipe(usbdev, epdesc, streams);
+    return usb_alloc_pipe(usbdev, epdesc);
+}
+
 // Free an allocated control or bulk pipe.
 void
 usb_free_pipe(struct usbdevice_s *usbdev, struct usb_pipe *pipe)
@@ -129,6 +180,33 @@ usb_send_bulk(struct usb_pipe *pipe_fl, int dir, void *data, int datasize)
     return usb_send_pipe(pipe_fl, dir, NULL, data, datasize);
 }
 
+// Queue a transfer on a stream of a bulk pipe (does not wait)
+int
+usb_send_stream(struct usb_pipe *pipe_fl, u16 stream, void *data, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_send_stream(pipe_fl, stream, data, datasize);
+}
+
+// Wait for the transfers queued on a stream of a bulk pipe
+int
+usb_wait_stream(struct usb_pipe *pipe_fl, u16 stream, int datasize)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_wait_stream(pipe_fl, stream, datasize);
+}
+
+// Discard the transfers still queued on a stream of a bulk pipe
+int
+usb_cancel_stream(struct usb_pipe *pipe_fl, u16 stream)
+{
+    if (MODESEGMENT || GET_LOWFLAT(pipe_fl->type) != USB_TYPE_XHCI)
+        return -1;
+    return xhci_cancel_stream(pipe_fl, stream);
+}
+
 // Check if a pipe for a given controller is on the freelist
 int
 usb_is_freelist(struct usb_s *cntl, struct usb_pipe *pipe)
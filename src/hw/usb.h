@@ -16,6 +16,9 @@ struct usb_pipe {
     u8 speed;
     u16 maxpacket;
     u8 eptype;
+    u8 streams;
+    u8 irqdriven;
+    u8 irqseen;
 };
 
 // Common information for usb devices.
@@ -213,6 +216,17 @@ struct usb_endpoint_descriptor {
 
 #define USB_CONTROL_SETUP_SIZE          8
 
+struct usb_ss_ep_comp_descriptor {
+    u8  bLength;
+    u8  bDescriptorType;
+
+    u8  bMaxBurst;
+    u8  bmAttributes;
+    u16 wBytesPerInterval;
+} PACKED;
+
+#define USB_SS_EP_COMP_STREAMS_MASK     0x1f    /* in bmAttributes (bulk) */
+
 
 /****************************************************************
  * usb mass storage flags
@@ -232,9 +246,18 @@ struct usb_endpoint_descriptor {
 // usb.c
 int usb_send_bulk(struct usb_pipe *pipe, int dir, void *data, int datasize);
 int usb_poll_intr(struct usb_pipe *pipe, void *data);
+void handle_xhci_msi(void);
+int usb_reset_pipe(struct usb_pipe *pipe_fl);
 int usb_32bit_pipe(struct usb_pipe *pipe_fl);
 struct usb_pipe *usb_alloc_pipe(struct usbdevice_s *usbdev
                                 , struct usb_endpoint_descriptor *epdesc);
+struct usb_pipe *usb_alloc_stream_pipe(struct usbdevice_s *usbdev
+                                       , struct usb_endpoint_descriptor *epdesc
+                                       , int streams);
+int usb_send_stream(struct usb_pipe *pipe_fl, u16 stream
+                    , void *data, int datasize);
+int usb_wait_stream(struct usb_pipe *pipe_fl, u16 stream, int datasize);
+int usb_cancel_stream(struct usb_pipe *pipe_fl, u16 stream);
 void usb_free_pipe(struct usbdevice_s *usbdev, struct usb_pipe *pipe);
 int usb_send_default_control(struct usb_pipe *pipe
                              , const struct usb_ctrlrequest *req, void *data);
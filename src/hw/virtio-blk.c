@@ -18,65 +18,100 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-mmio.h"
 #include "virtio-ring.h"
 #include "virtio-blk.h"
 
+// Maximum requests queued per kick and data segments per request
+#define VIRTIO_BLK_MAX_REQS VRING_INDIRECT_TABLES
+#define VIRTIO_BLK_MAX_SEGS (VRING_INDIRECT_NUM - 2)
+
 struct virtiodrive_s {
     struct drive_s drive;
     struct vring_virtqueue *vq;
     struct vp_device vp;
+    u32 size_max;
+    u16 seg_max;
+    u16 max_req_sectors;
 };
 
+// Add a request for 'count' sectors at 'lba' to the virtqueue, splitting
+// the data buffer into segments of at most size_max bytes.
+static void
+virtio_blk_add_req(struct virtiodrive_s *vdrive, struct virtio_blk_outhdr *hdr,
+                   u8 *status, char *buf, u32 count, int write, int req)
+{
+    struct vring_list sg[VIRTIO_BLK_MAX_SEGS + 2];
+    u32 len = count * DISK_SECTOR_SIZE;
+    int nseg = 0;
+
+    sg[0].addr = (void*)hdr;
+    sg[0].length = sizeof(*hdr);
+    while (len) {
+        u32 seglen = len < vdrive->size_max ? len : vdrive->size_max;
+        nseg++;
+        sg[nseg].addr = buf;
+        sg[nseg].length = seglen;
+        buf += seglen;
+        len -= seglen;
+    }
+    sg[nseg + 1].addr = (void*)status;
+    sg[nseg + 1].length = sizeof(*status);
+
+    if (write)
+        vring_add_buf(vdrive->vq, sg, nseg + 1, 1, req, req);
+    else
+        vring_add_buf(vdrive->vq, sg, 1, nseg + 1, req, req);
+}
+
 static int
 virtio_blk_op(struct disk_op_s *op, int write)
 {
     struct virtiodrive_s *vdrive =
         container_of(op->drive_fl, struct virtiodrive_s, drive);
     struct vring_virtqueue *vq = vdrive->vq;
-    struct virtio_blk_outhdr hdr = {
-        .type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
-        .ioprio = 0,
-        .sector = op->lba,
-    };
-    u8 status = VIRTIO_BLK_S_UNSUPP;
-    struct vring_list sg[] = {
-        {
-            .addr       = (void*)(&hdr),
-            .length     = sizeof(hdr),
-        },
-        {
-            .addr       = op->buf_fl,
-            .length     = vdrive->drive.blksize * op->count,
-        },
-        {
-            .addr       = (void*)(&status),
-            .length     = sizeof(status),
-        },
-    };
-
-    /* Add to virtqueue and kick host */
-    if (write)
-        vring_add_buf(vq, sg, 2, 1, 0, 0);
-    else
-        vring_add_buf(vq, sg, 1, 2, 0, 0);
-    vring_kick(&vdrive->vp, vq, 1);
+    struct virtio_blk_outhdr hdr[VIRTIO_BLK_MAX_REQS];
+    u8 status[VIRTIO_BLK_MAX_REQS];
+    int max_reqs = vq->indirect ? VIRTIO_BLK_MAX_REQS : 1;
+    u32 done = 0;
+
+    while (done < op->count) {
+        /* Add as many requests as possible and kick host once */
+        int reqs, i;
+        for (reqs = 0; reqs < max_reqs && done < op->count; reqs++) {
+            u32 count = op->count - done;
+            if (count > vdrive->max_req_sectors)
+                count = vdrive->max_req_sectors;
+            hdr[reqs].type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+            hdr[reqs].ioprio = 0;
+            hdr[reqs].sector = op->lba + done;
+            status[reqs] = VIRTIO_BLK_S_UNSUPP;
+            virtio_blk_add_req(vdrive, &hdr[reqs], &status[reqs],
+                               op->buf_fl + done * DISK_SECTOR_SIZE,
+                               count, write, reqs);
+            done += count;
+        }
+        vring_kick(&vdrive->vp, vq, reqs);
 
-    /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+        /* Wait for replies and reclaim virtqueue elements */
+        for (i = 0; i < reqs; i++) {
+            vring_wait_used(vq);
+            vring_get_buf(vq, NULL);
+        }
 
-    /* Reclaim virtqueue element */
-    vring_get_buf(vq, NULL);
+        /* Clear interrupt status register.  Avoid leaving interrupts stuck if
+         * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
+         */
+        vp_get_isr(&vdrive->vp);
 
-    /* Clear interrupt status register.  Avoid leaving interrupts stuck if
-     * VRING_AVAIL_F_NO_INTERRUPT was ignored and interrupts were raised.
-     */
-    vp_get_isr(&vdrive->vp);
+        for (i = 0; i < reqs; i++)
+            if (status[i] != VIRTIO_BLK_S_OK)
+                return DISK_RET_EBADTRACK;
+    }
 
-    return status == VIRTIO_BLK_S_OK ? DISK_RET_SUCCESS : DISK_RET_EBADTRACK;
+    return DISK_RET_SUCCESS;
 }
 
 int
@@ -94,6 +129,52 @@ virtio_blk_process_op(struct disk_op_s *op)
     }
 }
 
+// Features the driver wants from the device
+static u64
+virtio_blk_features(void)
+{
+    return ((1ull << VIRTIO_F_VERSION_1) | (1ull << VIRTIO_F_IOMMU_PLATFORM)
+            | (1ull << VIRTIO_BLK_F_BLK_SIZE) | (1ull << VIRTIO_BLK_F_SEG_MAX)
+            | (1ull << VIRTIO_BLK_F_SIZE_MAX)
+            | (1ull << VIRTIO_RING_F_INDIRECT_DESC)
+            | (1ull << VIRTIO_F_RING_PACKED)
+            | (1ull << VIRTIO_RING_F_EVENT_IDX));
+}
+
+// Determine how large a single request may be from the device's segment
+// limits and set up indirect descriptors if they were negotiated.
+static void
+virtio_blk_setup_limits(struct virtiodrive_s *vdrive, u64 features,
+                        u32 size_max, u32 seg_max)
+{
+    struct vring_virtqueue *vq = vdrive->vq;
+
+    vring_enable_indirect(vq, features);
+
+    /* A request uses one descriptor each for the header and the status. */
+    u32 num = vq->packed ? vq->vring_packed.num : vq->vring.num;
+    u32 max_segs = vq->indirect ? VIRTIO_BLK_MAX_SEGS : num - 2;
+    if (max_segs > VIRTIO_BLK_MAX_SEGS)
+        max_segs = VIRTIO_BLK_MAX_SEGS;
+    if (features & (1ull << VIRTIO_BLK_F_SEG_MAX) && seg_max
+        && seg_max < max_segs)
+        max_segs = seg_max;
+    vdrive->seg_max = max_segs;
+
+    vdrive->size_max = 0xffffffff;
+    if (features & (1ull << VIRTIO_BLK_F_SIZE_MAX)
+        && size_max >= DISK_SECTOR_SIZE)
+        vdrive->size_max = size_max;
+
+    u64 max_bytes = (u64)vdrive->size_max * vdrive->seg_max;
+    if (max_bytes > 0xffff * DISK_SECTOR_SIZE)
+        max_bytes = 0xffff * DISK_SECTOR_SIZE;
+    vdrive->max_req_sectors = (u32)max_bytes / DISK_SECTOR_SIZE;
+
+    dprintf(3, "virtio-blk seg_max=%u size_max=%u indirect=%d\n",
+            vdrive->seg_max, vdrive->size_max, vq->indirect != NULL);
+}
+
 static void
 init_virtio_blk(void *data)
 {
@@ -110,23 +191,18 @@ init_virtio_blk(void *data)
     vdrive->drive.cntl_id = pci->bdf;
 
     vp_init_simple(&vdrive->vp, pci);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
-        goto fail;
-    }
 
     if (vdrive->vp.use_modern) {
         struct vp_device *vp = &vdrive->vp;
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
-        u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
         u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        features = features & (version1 | iommu_platform | blk_size);
+        features = features & virtio_blk_features();
         vp_set_features(vp, features);
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
@@ -135,6 +211,12 @@ init_virtio_blk(void *data)
             goto fail;
         }
 
+        /* The ring layout depends on the negotiated features. */
+        if (vp_find_vq(vp, 0, &vdrive->vq) < 0 ) {
+            dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
+            goto fail;
+        }
+
         vdrive->drive.sectors =
             vp_read(&vp->device, struct virtio_blk_config, capacity);
         if (features & blk_size) {
@@ -157,11 +239,24 @@ init_virtio_blk(void *data)
             vp_read(&vp->device, struct virtio_blk_config, heads);
         vdrive->drive.pchs.sector =
             vp_read(&vp->device, struct virtio_blk_config, sectors);
+
+        virtio_blk_setup_limits(
+            vdrive, features,
+            vp_read(&vp->device, struct virtio_blk_config, size_max),
+            vp_read(&vp->device, struct virtio_blk_config, seg_max));
     } else {
+        /* The ring layout depends on the negotiated features. */
+        u64 f = vp_get_features(&vdrive->vp) & virtio_blk_features();
+        vp_set_features(&vdrive->vp, f);
+
+        if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
+            dprintf(1, "fail to find vq for virtio-blk %pP\n", pci);
+            goto fail;
+        }
+
         struct virtio_blk_config cfg;
         vp_get_legacy(&vdrive->vp, 0, &cfg, sizeof(cfg));
 
-        u64 f = vp_get_features(&vdrive->vp);
         vdrive->drive.blksize = (f & (1 << VIRTIO_BLK_F_BLK_SIZE)) ?
             cfg.blk_size : DISK_SECTOR_SIZE;
 
@@ -177,6 +272,8 @@ init_virtio_blk(void *data)
         vdrive->drive.pchs.cylinder = cfg.cylinders;
         vdrive->drive.pchs.head = cfg.heads;
         vdrive->drive.pchs.sector = cfg.sectors;
+
+        virtio_blk_setup_limits(vdrive, f, cfg.size_max, cfg.seg_max);
     }
 
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk PCI:%pP", pci);
@@ -190,6 +287,8 @@ init_virtio_blk(void *data)
 
 fail:
     vp_reset(&vdrive->vp);
+    if (vdrive->vq)
+        free(vdrive->vq->indirect);
     free(vdrive->vq);
     free(vdrive);
 }
@@ -209,17 +308,13 @@ init_virtio_blk_mmio(void *mmio)
     vdrive->drive.cntl_id = (u32)mmio;
 
     vp_init_mmio(&vdrive->vp, mmio);
-    if (vp_find_vq(&vdrive->vp, 0, &vdrive->vq) < 0 ) {
-        dprintf(1, "fail to find vq for virtio-blk-mmio %p\n", mmio);
-        goto fail;
-    }
 
     struct vp_device *vp = &vdrive->vp;
     u64 features = vp_get_features(vp);
-    u64 version1 = 1ull << VIRTIO_F_VERSION_1;
     u64 blk_size = 1ull << VIRTIO_BLK_F_BLK_SIZE;
+    u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
 
-    features = features & (version1 | blk_size);
+    features = features & virtio_blk_features() & ~iommu_platform;
     vp_set_features(vp, features);
     status |= VIRTIO_CONFIG_S_FEATURES_OK;
     vp_set_status(vp, status);
@@ -228,6 +323,11 @@ init_virtio_blk_mmio(void *mmio)
         goto fail;
     }
 
+    if (vp_find_vq(vp, 0, &vdrive->vq) < 0 ) {
+        dprintf(1, "fail to find vq for virtio-blk-mmio %p\n", mmio);
+        goto fail;
+    }
+
     vdrive->drive.sectors =
         vp_read(&vp->device, struct virtio_blk_config, capacity);
     if (features & blk_size) {
@@ -251,6 +351,11 @@ init_virtio_blk_mmio(void *mmio)
     vdrive->drive.pchs.sector =
         vp_read(&vp->device, struct virtio_blk_config, sectors);
 
+    virtio_blk_setup_limits(
+        vdrive, features,
+        vp_read(&vp->device, struct virtio_blk_config, size_max),
+        vp_read(&vp->device, struct virtio_blk_config, seg_max));
+
     char *desc = znprintf(MAXDESCSIZE, "Virtio disk mmio:%p", mmio);
     boot_add_hd(&vdrive->drive, desc, bootprio_find_mmio_device(mmio));
 
@@ -260,6 +365,8 @@ init_virtio_blk_mmio(void *mmio)
 
 fail:
     vp_reset(&vdrive->vp);
+    if (vdrive->vq)
+        free(vdrive->vq->indirect);
     free(vdrive->vq);
     free(vdrive);
 }
@@ -288,6 +395,6 @@ virtio_blk_setup(void)
             continue;
         }
 
-        run_thread(init_virtio_blk, pci);
+        boot_probe_pci(init_virtio_blk, pci);
     }
 }
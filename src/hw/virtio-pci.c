@@ -193,7 +193,8 @@ u64 vp_get_features(struct vp_device *vp)
     if (vp->use_mmio) {
         vp_write(&vp->common, virtio_mmio_cfg, device_feature_select, 0);
         f0 = vp_read(&vp->common, virtio_mmio_cfg, device_feature);
-        f1 = 0;
+        vp_write(&vp->common, virtio_mmio_cfg, device_feature_select, 1);
+        f1 = vp_read(&vp->common, virtio_mmio_cfg, device_feature);
     } else if (vp->use_modern) {
         vp_write(&vp->common, virtio_pci_common_cfg, device_feature_select, 0);
         f0 = vp_read(&vp->common, virtio_pci_common_cfg, device_feature);
@@ -213,9 +214,15 @@ void vp_set_features(struct vp_device *vp, u64 features)
     f0 = features;
     f1 = features >> 32;
 
+    /* Queues set up from now on use the negotiated ring layout. */
+    vp->use_packed = !!(features & (1ull << VIRTIO_F_RING_PACKED));
+    vp->use_event_idx = !!(features & (1ull << VIRTIO_RING_F_EVENT_IDX));
+
     if (vp->use_mmio) {
-        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, f0);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, 0);
         vp_write(&vp->common, virtio_mmio_cfg, guest_feature, f0);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature_select, 1);
+        vp_write(&vp->common, virtio_mmio_cfg, guest_feature, f1);
     } else if (vp->use_modern) {
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature_select, 0);
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature, f0);
@@ -223,6 +230,7 @@ void vp_set_features(struct vp_device *vp, u64 features)
         vp_write(&vp->common, virtio_pci_common_cfg, guest_feature, f1);
     } else {
         vp_write(&vp->legacy, virtio_pci_legacy, guest_features, f0);
+        vp->use_packed = 0;
     }
 }
 
@@ -374,48 +382,70 @@ int vp_find_vq(struct vp_device *vp, int queue_index,
    vq->queue_index = queue_index;
 
    /* initialize the queue */
-   struct vring * vr = &vq->vring;
-   vring_init(vr, num, (unsigned char*)&vq->queue);
+   void *desc, *driver, *device;
+   if (vp->use_packed) {
+       struct vring_packed *vr = &vq->vring_packed;
+       vring_init_packed(vr, num, (unsigned char*)&vq->queue);
+       vq->packed = 1;
+       vq->avail_wrap_counter = 1;
+       vq->used_wrap_counter = 1;
+       desc = vr->desc;
+       driver = vr->driver;
+       device = vr->device;
+   } else {
+       struct vring * vr = &vq->vring;
+       vring_init(vr, num, (unsigned char*)&vq->queue);
+       if (vp->use_event_idx)
+           vring_used_event(vr) = vq->last_used_idx - 1;
+       desc = vr->desc;
+       driver = vr->avail;
+       device = vr->used;
+   }
+   vq->event_idx = vp->use_event_idx;
+   dprintf(3, "vq %d: %d entries, %s ring%s\n", queue_index, num,
+           vq->packed ? "packed" : "split",
+           vq->event_idx ? ", event idx" : "");
 
    /* activate the queue
     *
-    * NOTE: vr->desc is initialized by vring_init()
+    * NOTE: desc, driver and device areas are initialized by vring_init()
+    * or vring_init_packed()
     */
 
    if (vp->use_mmio) {
        if (vp_read(&vp->common, virtio_mmio_cfg, version) == 2) {
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_lo,
-                    (unsigned long)virt_to_phys(vr->desc));
+                    (unsigned long)virt_to_phys(desc));
            vp_write(&vp->common, virtio_mmio_cfg, queue_desc_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_lo,
-                    (unsigned long)virt_to_phys(vr->avail));
+                    (unsigned long)virt_to_phys(driver));
            vp_write(&vp->common, virtio_mmio_cfg, queue_driver_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_lo,
-                    (unsigned long)virt_to_phys(vr->used));
+                    (unsigned long)virt_to_phys(device));
            vp_write(&vp->common, virtio_mmio_cfg, queue_device_hi, 0);
            vp_write(&vp->common, virtio_mmio_cfg, queue_ready, 1);
        } else {
            vp_write(&vp->common, virtio_mmio_cfg, legacy_guest_page_size,
                     (unsigned long)1 << PAGE_SHIFT);
            vp_write(&vp->common, virtio_mmio_cfg, legacy_queue_pfn,
-                    (unsigned long)virt_to_phys(vr->desc) >> PAGE_SHIFT);
+                    (unsigned long)virt_to_phys(desc) >> PAGE_SHIFT);
        }
    } else if (vp->use_modern) {
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_lo,
-                (unsigned long)virt_to_phys(vr->desc));
+                (unsigned long)virt_to_phys(desc));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_desc_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_lo,
-                (unsigned long)virt_to_phys(vr->avail));
+                (unsigned long)virt_to_phys(driver));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_avail_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_lo,
-                (unsigned long)virt_to_phys(vr->used));
+                (unsigned long)virt_to_phys(device));
        vp_write(&vp->common, virtio_pci_common_cfg, queue_used_hi, 0);
        vp_write(&vp->common, virtio_pci_common_cfg, queue_enable, 1);
        vq->queue_notify_off = vp_read(&vp->common, virtio_pci_common_cfg,
                                       queue_notify_off);
    } else {
        vp_write(&vp->legacy, virtio_pci_legacy, queue_pfn,
-                (unsigned long)virt_to_phys(vr->desc) >> PAGE_SHIFT);
+                (unsigned long)virt_to_phys(desc) >> PAGE_SHIFT);
    }
    return num;
 
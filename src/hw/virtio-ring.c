@@ -16,7 +16,11 @@
  *
  */
 
+#include "malloc.h" // memalign_high
 #include "output.h" // panic
+#include "stacks.h" // yield
+#include "string.h" // memset
+#include "x86.h" // cpu_relax
 #include "virtio-ring.h"
 #include "virtio-pci.h"
 
@@ -34,6 +38,17 @@
 
 int vring_more_used(struct vring_virtqueue *vq)
 {
+    if (vq->packed) {
+        /* A descriptor is used once its avail and used bits both match
+         * the used wrap counter. */
+        u16 flags = vq->vring_packed.desc[vq->last_used_idx].flags;
+        int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+        int used = !!(flags & VRING_PACKED_DESC_F_USED);
+        int more = avail == used && used == vq->used_wrap_counter;
+        smp_rmb();
+        return more;
+    }
+
     struct vring_used *used = vq->vring.used;
     int more = vq->last_used_idx != used->idx;
     /* Make sure ring reads are done after idx read above. */
@@ -65,6 +80,22 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
     vq->free_head = head;
 }
 
+/*
+ * vring_put_indirect
+ *
+ * hand the indirect table used by buffer 'head' back to the pool
+ */
+
+static void vring_put_indirect(struct vring_virtqueue *vq, unsigned int head)
+{
+    int table;
+
+    for (table = 0; table < VRING_INDIRECT_TABLES; table++)
+        if (vq->indirect_busy & (1 << table)
+            && vq->indirect_head[table] == head)
+            vq->indirect_busy &= ~(1 << table);
+}
+
 /*
  * vring_get_buf
  *
@@ -72,6 +103,27 @@ void vring_detach(struct vring_virtqueue *vq, unsigned int head)
  *
  */
 
+static int vring_get_buf_packed(struct vring_virtqueue *vq, unsigned int *len)
+{
+    struct vring_packed *vr = &vq->vring_packed;
+    struct vring_packed_desc *desc = &vr->desc[vq->last_used_idx];
+    u16 id = desc->id;
+
+    if (len != NULL)
+        *len = desc->len;
+
+    vring_put_indirect(vq, id);
+
+    /* skip all descriptors of the buffer */
+    vq->last_used_idx += vq->desc_count[id];
+    if (vq->last_used_idx >= vr->num) {
+        vq->last_used_idx -= vr->num;
+        vq->used_wrap_counter ^= 1;
+    }
+
+    return vq->vdata[id];
+}
+
 int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 {
     struct vring *vr = &vq->vring;
@@ -82,6 +134,9 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 
 //    BUG_ON(!vring_more_used(vq));
 
+    if (vq->packed)
+        return vring_get_buf_packed(vq, len);
+
     elem = &used->ring[vq->last_used_idx % vr->num];
     id = elem->id;
     if (len != NULL)
@@ -89,13 +144,128 @@ int vring_get_buf(struct vring_virtqueue *vq, unsigned int *len)
 
     ret = vq->vdata[id];
 
+    if (vr->desc[id].flags & VRING_DESC_F_INDIRECT)
+        vring_put_indirect(vq, id);
+
     vring_detach(vq, id);
 
     vq->last_used_idx = vq->last_used_idx + 1;
 
+    /* Keep used_event behind the used index, so the device never has a
+     * reason to interrupt. */
+    if (vq->event_idx)
+        vring_used_event(vr) = vq->last_used_idx - 1;
+
     return ret;
 }
 
+/*
+ * vring_get_indirect
+ *
+ * put the buffer list into a free indirect table.  Returns the table, or
+ * NULL if no indirect table can hold the list.
+ */
+
+static void *vring_get_indirect(struct vring_virtqueue *vq,
+                                struct vring_list list[],
+                                unsigned int out, unsigned int in, int head)
+{
+    int table, i;
+
+    if (!vq->indirect || out + in < 2 || out + in > VRING_INDIRECT_NUM)
+        return NULL;
+    for (table = 0; table < VRING_INDIRECT_TABLES; table++)
+        if (!(vq->indirect_busy & (1 << table)))
+            break;
+    if (table == VRING_INDIRECT_TABLES)
+        return NULL;
+    vq->indirect_busy |= 1 << table;
+    vq->indirect_head[table] = head;
+
+    struct vring_desc *idesc = &vq->indirect[table * VRING_INDIRECT_NUM];
+    if (vq->packed) {
+        /* packed rings use the packed layout in indirect tables, too */
+        struct vring_packed_desc *pdesc = (void*)idesc;
+        for (i = 0; i < out + in; i++, list++) {
+            pdesc[i].flags = i < out ? 0 : VRING_DESC_F_WRITE;
+            pdesc[i].addr = (u64)virt_to_phys(list->addr);
+            pdesc[i].len = list->length;
+            pdesc[i].id = 0;
+        }
+        return idesc;
+    }
+
+    for (i = 0; i < out + in; i++, list++) {
+        idesc[i].flags = (i < out ? 0 : VRING_DESC_F_WRITE) | VRING_DESC_F_NEXT;
+        idesc[i].addr = (u64)virt_to_phys(list->addr);
+        idesc[i].len = list->length;
+        idesc[i].next = i + 1;
+    }
+    idesc[i - 1].flags &= ~VRING_DESC_F_NEXT;
+    return idesc;
+}
+
+/*
+ * vring_add_buf_packed
+ *
+ * make a buffer available in a packed ring.  The flags of the first
+ * descriptor are written last, which hands the whole chain to the device.
+ */
+
+static void vring_add_buf_packed(struct vring_virtqueue *vq,
+                                 struct vring_list list[],
+                                 unsigned int out, unsigned int in,
+                                 int index)
+{
+    struct vring_packed *vr = &vq->vring_packed;
+    struct vring_packed_desc *desc = vr->desc;
+    struct vring_list ilist;
+    u16 head = vq->free_head, i = head, head_flags = 0;
+    unsigned int n, count = out + in;
+
+    struct vring_desc *idesc = vring_get_indirect(vq, list, out, in, head);
+    if (idesc) {
+        ilist.addr = (void*)idesc;
+        ilist.length = sizeof(*idesc) * count;
+        list = &ilist;
+        out = count = 1;
+        in = 0;
+    }
+
+    for (n = 0; n < count; n++, list++) {
+        u16 flags = (vq->avail_wrap_counter ? VRING_PACKED_DESC_F_AVAIL
+                     : VRING_PACKED_DESC_F_USED);
+        if (idesc)
+            flags |= VRING_DESC_F_INDIRECT;
+        if (n >= out)
+            flags |= VRING_DESC_F_WRITE;
+        if (n + 1 < count)
+            flags |= VRING_DESC_F_NEXT;
+
+        desc[i].addr = (u64)virt_to_phys(list->addr);
+        desc[i].len = list->length;
+        desc[i].id = head;
+        if (n)
+            desc[i].flags = flags;
+        else
+            head_flags = flags;
+
+        if (++i >= vr->num) {
+            i = 0;
+            vq->avail_wrap_counter ^= 1;
+        }
+    }
+
+    vq->free_head = i;
+    vq->vdata[head] = index;
+    vq->desc_count[head] = count;
+    vq->kick_added += count;
+
+    /* Make sure the chain is written before the device can see it. */
+    smp_wmb();
+    desc[head].flags = head_flags;
+}
+
 void vring_add_buf(struct vring_virtqueue *vq,
                    struct vring_list list[],
                    unsigned int out, unsigned int in,
@@ -108,8 +278,22 @@ void vring_add_buf(struct vring_virtqueue *vq,
 
     BUG_ON(out + in == 0);
 
-    prev = 0;
+    if (vq->packed) {
+        vring_add_buf_packed(vq, list, out, in, index);
+        return;
+    }
+
     head = vq->free_head;
+    struct vring_desc *idesc = vring_get_indirect(vq, list, out, in, head);
+    if (idesc) {
+        desc[head].flags = VRING_DESC_F_INDIRECT;
+        desc[head].addr = (u64)virt_to_phys(idesc);
+        desc[head].len = sizeof(*idesc) * (out + in);
+        i = desc[head].next;
+        goto added;
+    }
+
+    prev = 0;
     for (i = head; out; i = desc[i].next, out--) {
         desc[i].flags = VRING_DESC_F_NEXT;
         desc[i].addr = (u64)virt_to_phys(list->addr);
@@ -126,6 +310,7 @@ void vring_add_buf(struct vring_virtqueue *vq,
     }
     desc[prev].flags = desc[prev].flags & ~VRING_DESC_F_NEXT;
 
+added:
     vq->free_head = i;
 
     vq->vdata[head] = index;
@@ -134,14 +319,100 @@ void vring_add_buf(struct vring_virtqueue *vq,
     avail->ring[av] = head;
 }
 
+/*
+ * vring_kick_packed_needed
+ *
+ * check the device event suppression area of a packed ring
+ */
+
+static int vring_kick_packed_needed(struct vring_virtqueue *vq)
+{
+    struct vring_packed *vr = &vq->vring_packed;
+    u16 new = vq->free_head, old = new - vq->kick_added;
+    u16 off_wrap = vr->device->off_wrap, flags = vr->device->flags;
+
+    vq->kick_added = 0;
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC)
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+
+    u16 event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+    if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != vq->avail_wrap_counter)
+        event -= vr->num;
+    return vring_need_event(event, new, old);
+}
+
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added)
 {
+    if (vq->packed) {
+        /* Buffers were made available by vring_add_buf() already. */
+        smp_mb();
+        if (vring_kick_packed_needed(vq))
+            vp_notify(vp, vq);
+        return;
+    }
+
     struct vring *vr = &vq->vring;
     struct vring_avail *avail = vr->avail;
+    u16 old = avail->idx, new = old + num_added;
+    int needed;
 
     /* Make sure idx update is done after ring write. */
     smp_wmb();
-    avail->idx = avail->idx + num_added;
+    avail->idx = new;
+
+    /* Make sure the device sees the new idx before we check whether it
+     * wants to be notified. */
+    smp_mb();
+    if (vq->event_idx)
+        needed = vring_need_event(vring_avail_event(vr), new, old);
+    else
+        needed = !(vr->used->flags & VRING_USED_F_NO_NOTIFY);
+    if (needed)
+        vp_notify(vp, vq);
+}
+
+/*
+ * vring_wait_used
+ *
+ * wait for the device to return a buffer.  Requests usually complete
+ * quickly, so spin on the ring for a while before yielding between polls.
+ */
+
+void vring_wait_used(struct vring_virtqueue *vq)
+{
+    int spins = VRING_POLL_SPINS;
+
+    while (!vring_more_used(vq)) {
+        if (spins) {
+            spins--;
+            cpu_relax();
+        } else {
+            yield();
+        }
+    }
+}
 
-    vp_notify(vp, vq);
+/*
+ * vring_enable_indirect
+ *
+ * allocate the indirect descriptor tables if VIRTIO_RING_F_INDIRECT_DESC
+ * is among the negotiated features.  Without them vring_add_buf()
+ * silently falls back to descriptor chains in the ring.
+ */
+
+void vring_enable_indirect(struct vring_virtqueue *vq, u64 features)
+{
+    ASSERT32FLAT();
+    if (!(features & (1ull << VIRTIO_RING_F_INDIRECT_DESC)))
+        return;
+
+    u32 size = sizeof(struct vring_desc) * VRING_INDIRECT_NUM
+        * VRING_INDIRECT_TABLES;
+    vq->indirect = memalign_high(sizeof(struct vring_desc), size);
+    if (!vq->indirect) {
+        warn_noalloc();
+        return;
+    }
+    memset(vq->indirect, 0, size);
+    vq->indirect_busy = 0;
 }
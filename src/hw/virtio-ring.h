@@ -20,15 +20,38 @@
 #define VIRTIO_F_VERSION_1              32
 #define VIRTIO_F_IOMMU_PLATFORM         33
 
+/* Support for indirect descriptors */
+#define VIRTIO_RING_F_INDIRECT_DESC     28
+/* The used_event and avail_event fields are valid */
+#define VIRTIO_RING_F_EVENT_IDX         29
+/* Support for the packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED            34
+
 #define MAX_QUEUE_NUM      (256)
 
 #define VRING_DESC_F_NEXT  1
 #define VRING_DESC_F_WRITE 2
+#define VRING_DESC_F_INDIRECT 4
+
+/* Indirect descriptor tables per virtqueue, and descriptors per table. */
+#define VRING_INDIRECT_TABLES 4
+#define VRING_INDIRECT_NUM    32
 
 #define VRING_AVAIL_F_NO_INTERRUPT 1
 
 #define VRING_USED_F_NO_NOTIFY     1
 
+#define VRING_PACKED_DESC_F_AVAIL  (1 << 7)
+#define VRING_PACKED_DESC_F_USED   (1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
+/* Number of times vring_wait_used() polls before yielding between polls. */
+#define VRING_POLL_SPINS 1024
+
 struct vring_desc
 {
    u64 addr;
@@ -64,19 +87,69 @@ struct vring {
    struct vring_used *used;
 };
 
+struct vring_packed_desc
+{
+   u64 addr;
+   u32 len;
+   u16 id;
+   u16 flags;
+};
+
+struct vring_packed_desc_event
+{
+   u16 off_wrap;
+   u16 flags;
+};
+
+struct vring_packed {
+   unsigned int num;
+   struct vring_packed_desc *desc;
+   struct vring_packed_desc_event *driver;
+   struct vring_packed_desc_event *device;
+};
+
 #define vring_size(num) \
     (ALIGN(sizeof(struct vring_desc) * num + sizeof(struct vring_avail) \
-           + sizeof(u16) * num, PAGE_SIZE)                              \
-     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num)
+           + sizeof(u16) * (num + 1), PAGE_SIZE)                        \
+     + sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num \
+     + sizeof(u16))
+
+/* Event index fields (VIRTIO_RING_F_EVENT_IDX) at the end of the rings */
+#define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
+#define vring_avail_event(vr) (*(u16 *)&(vr)->used->ring[(vr)->num])
+
+/* Does the other side want an event, given it asked for one at event_idx
+ * and the index moved from old to new_idx? */
+static inline int
+vring_need_event(u16 event_idx, u16 new_idx, u16 old)
+{
+   return (u16)(new_idx - event_idx - 1) < (u16)(new_idx - old);
+}
 
 typedef unsigned char virtio_queue_t[vring_size(MAX_QUEUE_NUM)];
 
 struct vring_virtqueue {
    virtio_queue_t queue;
    struct vring vring;
+   struct vring_packed vring_packed;
+   /* Packed ring state (VIRTIO_F_RING_PACKED) */
+   u8 packed;
+   u8 avail_wrap_counter;
+   u8 used_wrap_counter;
+   /* Packed ring: descriptors made available since the last kick */
+   u16 kick_added;
+   /* VIRTIO_RING_F_EVENT_IDX was negotiated */
+   u8 event_idx;
+   /* Split ring: head of the free list, packed ring: next free slot */
    u16 free_head;
    u16 last_used_idx;
    u16 vdata[MAX_QUEUE_NUM];
+   /* Packed ring: number of ring descriptors used by each buffer id */
+   u16 desc_count[MAX_QUEUE_NUM];
+   /* Indirect descriptor tables, NULL if indirect descriptors are not used */
+   struct vring_desc *indirect;
+   u8 indirect_busy;
+   u16 indirect_head[VRING_INDIRECT_TABLES];
    /* PCI */
    int queue_index;
    int queue_notify_off;
@@ -109,6 +182,21 @@ vring_init(struct vring *vr, unsigned int num, unsigned char *queue)
    vr->desc[i].next = 0;
 }
 
+static inline void
+vring_init_packed(struct vring_packed *vr, unsigned int num,
+                  unsigned char *queue)
+{
+   ASSERT32FLAT();
+   vr->num = num;
+
+   vr->desc = (void*)ALIGN((u32)queue, PAGE_SIZE);
+   vr->driver = (struct vring_packed_desc_event *)&vr->desc[num];
+   vr->device = &vr->driver[1];
+
+   /* disable interrupts */
+   vr->driver->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+}
+
 struct vp_device;
 int vring_more_used(struct vring_virtqueue *vq);
 void vring_detach(struct vring_virtqueue *vq, unsigned int head);
@@ -117,5 +205,7 @@ void vring_add_buf(struct vring_virtqueue *vq, struct vring_list list[],
                    unsigned int out, unsigned int in,
                    int index, int num_added);
 void vring_kick(struct vp_device *vp, struct vring_virtqueue *vq, int num_added);
+void vring_enable_indirect(struct vring_virtqueue *vq, u64 features);
+void vring_wait_used(struct vring_virtqueue *vq);
 
 #endif /* _VIRTIO_RING_H_ */
@@ -18,7 +18,7 @@
 #include "stacks.h" // run_thread
 #include "std/disk.h" // DISK_RET_SUCCESS
 #include "string.h" // memset
-#include "util.h" // usleep, bootprio_find_pci_device, is_bootprio_strict
+#include "util.h" // bootprio_find_pci_device, is_bootprio_strict
 #include "virtio-pci.h"
 #include "virtio-ring.h"
 #include "virtio-scsi.h"
@@ -79,8 +79,7 @@ virtio_scsi_process_op(struct disk_op_s *op)
     vring_kick(vp, vq, 1);
 
     /* Wait for reply */
-    while (!vring_more_used(vq))
-        usleep(5);
+    vring_wait_used(vq);
 
     /* Reclaim virtqueue element */
     vring_get_buf(vq, NULL);
@@ -105,6 +104,7 @@ virtio_scsi_init_lun(struct virtio_lun_s *vlun,
     memset(vlun, 0, sizeof(*vlun));
     vlun->drive.type = DTYPE_VIRTIO_SCSI;
     vlun->drive.cntl_id = pci->bdf;
+    vlun->drive.unit_id = (target << 16) | lun;
     vlun->pci = pci;
     vlun->mmio = mmio;
     vlun->vp = vp;
@@ -159,13 +159,14 @@ fail:
 }
 
 static int
-virtio_scsi_scan_target(struct pci_device *pci, void *mmio, struct vp_device *vp,
-                        struct vring_virtqueue *vq, u16 target)
+virtio_scsi_scan_target(u32 target, struct drive_s *tmpl_drv)
 {
-
+    struct virtio_lun_s *tmpl_vlun =
+        container_of(tmpl_drv, struct virtio_lun_s, drive);
     struct virtio_lun_s vlun0;
 
-    virtio_scsi_init_lun(&vlun0, pci, mmio, vp, vq, target, 0);
+    virtio_scsi_init_lun(&vlun0, tmpl_vlun->pci, tmpl_vlun->mmio,
+                         tmpl_vlun->vp, tmpl_vlun->vq, target, 0);
 
     int ret = scsi_rep_luns_scan(&vlun0.drive, virtio_scsi_add_lun);
     return ret < 0 ? 0 : ret;
@@ -189,12 +190,15 @@ init_virtio_scsi(void *data)
         u64 features = vp_get_features(vp);
         u64 version1 = 1ull << VIRTIO_F_VERSION_1;
         u64 iommu_platform = 1ull << VIRTIO_F_IOMMU_PLATFORM;
+        u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+        u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
         if (!(features & version1)) {
             dprintf(1, "modern device without virtio_1 feature bit: %pP\n", pci);
             goto fail;
         }
 
-        vp_set_features(vp, features & (version1 | iommu_platform));
+        vp_set_features(vp, features & (version1 | iommu_platform | packed
+                                         | event_idx));
         status |= VIRTIO_CONFIG_S_FEATURES_OK;
         vp_set_status(vp, status);
         if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
@@ -211,9 +215,9 @@ init_virtio_scsi(void *data)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(pci, NULL, vp, vq, i);
+    struct virtio_lun_s tmpl;
+    virtio_scsi_init_lun(&tmpl, pci, NULL, vp, vq, 0, 0);
+    int tot = scsi_parallel_scan(&tmpl.drive, 256, virtio_scsi_scan_target);
 
     if (!tot)
         goto fail;
@@ -239,6 +243,19 @@ init_virtio_scsi_mmio(void *mmio)
     vp_init_mmio(vp, mmio);
     u8 status = VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER;
 
+    u64 features = vp_get_features(vp);
+    u64 version1 = 1ull << VIRTIO_F_VERSION_1;
+    u64 packed = 1ull << VIRTIO_F_RING_PACKED;
+    u64 event_idx = 1ull << VIRTIO_RING_F_EVENT_IDX;
+
+    vp_set_features(vp, features & (version1 | packed | event_idx));
+    status |= VIRTIO_CONFIG_S_FEATURES_OK;
+    vp_set_status(vp, status);
+    if (!(vp_get_status(vp) & VIRTIO_CONFIG_S_FEATURES_OK)) {
+        dprintf(1, "device didn't accept features: %p\n", mmio);
+        goto fail;
+    }
+
     if (vp_find_vq(vp, 2, &vq) < 0 ) {
         dprintf(1, "fail to find vq for virtio-scsi-mmio %p\n", mmio);
         goto fail;
@@ -247,9 +264,9 @@ init_virtio_scsi_mmio(void *mmio)
     status |= VIRTIO_CONFIG_S_DRIVER_OK;
     vp_set_status(vp, status);
 
-    int i, tot;
-    for (tot = 0, i = 0; i < 256; i++)
-        tot += virtio_scsi_scan_target(NULL, mmio, vp, vq, i);
+    struct virtio_lun_s tmpl;
+    virtio_scsi_init_lun(&tmpl, NULL, mmio, vp, vq, 0, 0);
+    int tot = scsi_parallel_scan(&tmpl.drive, 256, virtio_scsi_scan_target);
 
     if (!tot)
         goto fail;
@@ -286,6 +303,6 @@ virtio_scsi_setup(void)
             continue;
         }
 
-        run_thread(init_virtio_scsi, pci);
+        boot_probe_pci(init_virtio_scsi, pci);
     }
 }
@@ -7,10 +7,12 @@
 #include "biosvar.h" // GET_BDA
 #include "config.h" // BUILD_BIOS_ADDR
 #include "e820map.h" // struct e820entry
+#include "fw/paravirt.h" // qemu_cfg_write_file
 #include "list.h" // hlist_node
 #include "malloc.h" // _malloc
 #include "memmap.h" // PAGE_SIZE
 #include "output.h" // dprintf
+#include "romfile.h" // romfile_find
 #include "stacks.h" // wait_preempt
 #include "std/optionrom.h" // OPTION_ROM_ALIGN
 #include "string.h" // memset
@@ -25,12 +27,39 @@ struct allocinfo_s {
 struct allocdetail_s {
     struct allocinfo_s detailinfo;
     struct allocinfo_s datainfo;
+    struct hlist_node hashnode, handlenode;
+    struct zone_s *zone;
     u32 handle;
 };
 
+// Small allocations from the temporary zones are carved out of slabs.
+// A slab is a page sized (and aligned) allocation holding objects of
+// a single size class, with this header at the start of the page.
+struct slab_s {
+    u32 magic;
+    u16 objsize, used;
+    void *freelist;
+    struct zone_s *zone;
+    struct hlist_node node;
+};
+
+#define SLAB_SIZE        PAGE_SIZE
+#define SLAB_MAGIC       0x62616c73 // "slab"
+#define SLAB_HEADER_SIZE ALIGN(sizeof(struct slab_s), MALLOC_MIN_ALIGN)
+#define SLAB_MIN_SHIFT   4
+#define SLAB_CLASSES     5
+#define SLAB_MAX_OBJ     (1 << (SLAB_MIN_SHIFT + SLAB_CLASSES - 1))
+
+// Allocation statistics for a zone.
+struct zonestats_s {
+    u32 allocs, frees, inuse, peak, slab_inuse;
+};
+
 // The various memory zones.
 struct zone_s {
     struct hlist_head head;
+    struct hlist_head slabs[SLAB_CLASSES]; // Slabs with free objects
+    struct zonestats_s stats;
 };
 
 struct zone_s ZoneLow VARVERIFY32INIT, ZoneHigh VARVERIFY32INIT;
@@ -40,6 +69,14 @@ struct zone_s ZoneTmpLow VARVERIFY32INIT, ZoneTmpHigh VARVERIFY32INIT;
 static struct zone_s *Zones[] VARVERIFY32INIT = {
     &ZoneTmpLow, &ZoneLow, &ZoneFSeg, &ZoneTmpHigh, &ZoneHigh
 };
+static const char *ZoneNames[] VARVERIFY32INIT = {
+    "TmpLow", "Low", "FSeg", "TmpHigh", "High"
+};
+
+// Tracked allocations hashed by address, and those with a handle set.
+#define ALLOC_HASH_SIZE 128
+static struct hlist_head AllocHash[ALLOC_HASH_SIZE] VARVERIFY32INIT;
+static struct hlist_head AllocHandles VARVERIFY32INIT;
 
 
 /****************************************************************
@@ -129,17 +166,20 @@ alloc_free(struct allocinfo_s *info)
     hlist_del(&info->node);
 }
 
-// Search all zones for an allocation obtained from alloc_new()
-static struct allocinfo_s *
+static struct hlist_head *
+alloc_hash_head(u32 data)
+{
+    return &AllocHash[(data / MALLOC_MIN_ALIGN) % ALLOC_HASH_SIZE];
+}
+
+// Find the tracked allocation starting at a given address
+static struct allocdetail_s *
 alloc_find(u32 data)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start == data)
-                return info;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, alloc_hash_head(data), hashnode) {
+        if (detail->datainfo.range_start == data)
+            return detail;
     }
     return NULL;
 }
@@ -231,14 +271,10 @@ zonelow_expand(u32 size, u32 align, struct allocinfo_s *fill)
  * tracked memory allocations
  ****************************************************************/
 
-// Allocate physical memory from the given zone and track it as a PMM allocation
-u32
-malloc_palloc(struct zone_s *zone, u32 size, u32 align)
+// Reserve and track space from the given zone
+static u32
+alloc_tracked(struct zone_s *zone, u32 size, u32 align)
 {
-    ASSERT32FLAT();
-    if (!size)
-        return 0;
-
     // Find and reserve space for main allocation
     struct allocdetail_s tempdetail;
     tempdetail.handle = MALLOC_DEFAULT_HANDLE;
@@ -258,14 +294,39 @@ malloc_palloc(struct zone_s *zone, u32 size, u32 align)
     dprintf(8, "phys_alloc zone=%p size=%d align=%x ret=%x (detail=%p)\n"
             , zone, size, align, data, detail);
 
+    detail->zone = zone;
+    hlist_add_head(&detail->hashnode, alloc_hash_head(data));
+    zone->stats.inuse += size;
+    if (zone->stats.inuse > zone->stats.peak)
+        zone->stats.peak = zone->stats.inuse;
     return data;
 }
 
-// Allocate virtual memory from the given zone
-void * __malloc
-_malloc(struct zone_s *zone, u32 size, u32 align)
+// Release space obtained from alloc_tracked()
+static void
+alloc_untrack(struct allocdetail_s *detail)
 {
-    return memremap(malloc_palloc(zone, size, align), size);
+    dprintf(8, "phys_free %x (detail=%p)\n"
+            , detail->datainfo.range_start, detail);
+    detail->zone->stats.inuse -= detail->datainfo.alloc_size;
+    hlist_del(&detail->hashnode);
+    if (detail->handle != MALLOC_DEFAULT_HANDLE)
+        hlist_del(&detail->handlenode);
+    alloc_free(&detail->datainfo);
+    alloc_free(&detail->detailinfo);
+}
+
+// Allocate physical memory from the given zone and track it as a PMM allocation
+u32
+malloc_palloc(struct zone_s *zone, u32 size, u32 align)
+{
+    ASSERT32FLAT();
+    if (!size)
+        return 0;
+    u32 data = alloc_tracked(zone, size, align);
+    if (data)
+        zone->stats.allocs++;
+    return data;
 }
 
 // Free a data block allocated with phys_alloc
@@ -273,23 +334,293 @@ int
 malloc_pfree(u32 data)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find(data);
+    if (!detail)
         return -1;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
-    dprintf(8, "phys_free %x (detail=%p)\n", data, detail);
-    alloc_free(info);
-    alloc_free(&detail->detailinfo);
+    detail->zone->stats.frees++;
+    alloc_untrack(detail);
+    return 0;
+}
+
+
+/****************************************************************
+ * Small object slabs
+ ****************************************************************/
+
+static int
+zone_has_slabs(struct zone_s *zone)
+{
+    return zone == &ZoneTmpHigh || zone == &ZoneTmpLow;
+}
+
+static int
+slab_class(u32 size)
+{
+    int cls = 0;
+    while ((1 << (SLAB_MIN_SHIFT + cls)) < size)
+        cls++;
+    return cls;
+}
+
+// Allocate a small object from the zone's slabs
+static void *
+slab_alloc(struct zone_s *zone, u32 size)
+{
+    int cls = slab_class(size);
+    struct hlist_head *head = &zone->slabs[cls];
+    struct slab_s *slab = container_of_or_null(head->first, struct slab_s, node);
+    if (!slab) {
+        u32 page = alloc_tracked(zone, SLAB_SIZE, SLAB_SIZE);
+        if (!page)
+            return NULL;
+        slab = memremap(page, SLAB_SIZE);
+        slab->magic = SLAB_MAGIC;
+        slab->objsize = 1 << (SLAB_MIN_SHIFT + cls);
+        slab->used = 0;
+        slab->zone = zone;
+        slab->freelist = NULL;
+        int i = (SLAB_SIZE - SLAB_HEADER_SIZE) / slab->objsize;
+        while (i--) {
+            void **obj = (void*)slab + SLAB_HEADER_SIZE + i * slab->objsize;
+            *obj = slab->freelist;
+            slab->freelist = obj;
+        }
+        hlist_add_head(&slab->node, head);
+    }
+
+    void **obj = slab->freelist;
+    slab->freelist = *obj;
+    slab->used++;
+    if (!slab->freelist)
+        // Slab is full
+        hlist_del(&slab->node);
+    zone->stats.slab_inuse += slab->objsize;
+    return obj;
+}
+
+// Free an object allocated with slab_alloc().  Returns -1 if the
+// address is not a slab object.
+static int
+slab_free(u32 data)
+{
+    u32 page = ALIGN_DOWN(data, SLAB_SIZE);
+    if (page == data)
+        return -1;
+    struct allocdetail_s *detail = alloc_find(page);
+    if (!detail || detail->datainfo.alloc_size != SLAB_SIZE)
+        return -1;
+    struct slab_s *slab = memremap(page, SLAB_SIZE);
+    if (slab->magic != SLAB_MAGIC || data < page + SLAB_HEADER_SIZE
+        || (data - page - SLAB_HEADER_SIZE) % slab->objsize)
+        return -1;
+
+    struct zone_s *zone = slab->zone;
+    struct hlist_head *head = &zone->slabs[slab_class(slab->objsize)];
+    if (!slab->freelist)
+        hlist_add_head(&slab->node, head);
+    void **obj = memremap(data, slab->objsize);
+    *obj = slab->freelist;
+    slab->freelist = obj;
+    slab->used--;
+    zone->stats.slab_inuse -= slab->objsize;
+    zone->stats.frees++;
+
+    if (!slab->used && (head->first != &slab->node || slab->node.next)) {
+        // Release empty slab (unless it's the only one with free space)
+        hlist_del(&slab->node);
+        slab->magic = 0;
+        alloc_untrack(detail);
+    }
     return 0;
 }
 
+
+/****************************************************************
+ * Allocation call site accounting
+ ****************************************************************/
+
+#define MALLOC_STATS_SITES 64
+#define MALLOC_STATS_HIST  8
+#define MALLOC_STATS_TOP   10
+
+// Allocations made from a single caller into a single zone.
+struct malloc_site_s {
+    void *caller;
+    struct zone_s *zone;
+    u32 count, bytes;
+};
+static struct malloc_site_s MallocSites[MALLOC_STATS_SITES] VARVERIFY32INIT;
+static int MallocSiteCount VARVERIFY32INIT;
+
+// Binary report exported via fw_cfg ("etc/malloc-stats").  The header
+// is followed by 'zones' zone records and then 'sites' site records.
+#define MALLOC_STATS_SIGNATURE 0x4154534d // "MSTA"
+
+struct malloc_stats_header_s {
+    u32 signature;
+    u16 version;
+    u8 zones, sites;
+} PACKED;
+
+struct malloc_stats_zone_s {
+    char name[8];
+    u32 allocs, frees, inuse, peak;
+    u32 free, largest;
+    u32 hist[MALLOC_STATS_HIST];
+} PACKED;
+
+struct malloc_stats_site_s {
+    u32 caller, zone, count, bytes;
+} PACKED;
+
+// Record an allocation made by 'caller'.  Once the table is full,
+// new call sites are accounted to a catch-all entry (with no caller
+// and no zone) in the last slot.
+static void
+malloc_stats_record(struct zone_s *zone, u32 size, void *caller)
+{
+    struct malloc_site_s *site;
+    int i;
+    for (i=0; i<MallocSiteCount; i++) {
+        site = &MallocSites[i];
+        if (site->zone == zone && site->caller == caller)
+            goto found;
+    }
+    site = &MallocSites[ARRAY_SIZE(MallocSites) - 1];
+    if (MallocSiteCount < ARRAY_SIZE(MallocSites) - 1) {
+        site = &MallocSites[MallocSiteCount++];
+        site->caller = caller;
+        site->zone = zone;
+    } else if (MallocSiteCount < ARRAY_SIZE(MallocSites)) {
+        MallocSiteCount++;
+    }
+found:
+    site->count++;
+    site->bytes += size;
+}
+
+// Fill in the report for a zone, including a histogram of the free
+// fragments (bucket N holds fragments smaller than 64 << 2*N bytes).
+static void
+malloc_stats_zone(int zoneidx, struct malloc_stats_zone_s *zs)
+{
+    struct zone_s *zone = Zones[zoneidx];
+    memset(zs, 0, sizeof(*zs));
+    strtcpy(zs->name, ZoneNames[zoneidx], sizeof(zs->name));
+    zs->allocs = zone->stats.allocs;
+    zs->frees = zone->stats.frees;
+    zs->inuse = zone->stats.inuse;
+    zs->peak = zone->stats.peak;
+    struct allocinfo_s *info;
+    hlist_for_each_entry(info, &zone->head, node) {
+        u32 space = info->range_end - info->range_start - info->alloc_size;
+        if (!space)
+            continue;
+        int bucket = 0;
+        while (bucket < MALLOC_STATS_HIST - 1
+               && space >= (64 << (2 * bucket)))
+            bucket++;
+        zs->hist[bucket]++;
+        zs->free += space;
+        if (space > zs->largest)
+            zs->largest = space;
+    }
+}
+
+// Report allocator statistics on the debug console and via fw_cfg.
+static void
+malloc_stats_report(void)
+{
+    // Sort call sites by total bytes allocated
+    int i, j;
+    for (i=1; i<MallocSiteCount; i++) {
+        struct malloc_site_s site = MallocSites[i];
+        for (j=i; j && MallocSites[j-1].bytes < site.bytes; j--)
+            MallocSites[j] = MallocSites[j-1];
+        MallocSites[j] = site;
+    }
+
+    // The report buffer itself is accounted, so don't include it
+    int sites = MallocSiteCount;
+    struct malloc_stats_header_s *hdr;
+    u32 size = (sizeof(*hdr) + ARRAY_SIZE(Zones)*sizeof(struct malloc_stats_zone_s)
+                + sites*sizeof(struct malloc_stats_site_s));
+    hdr = malloc_tmp(size);
+    if (!hdr) {
+        warn_noalloc();
+        return;
+    }
+    hdr->signature = MALLOC_STATS_SIGNATURE;
+    hdr->version = 1;
+    hdr->zones = ARRAY_SIZE(Zones);
+    hdr->sites = sites;
+
+    struct malloc_stats_zone_s *zs = (void*)&hdr[1];
+    for (i=0; i<ARRAY_SIZE(Zones); i++, zs++) {
+        malloc_stats_zone(i, zs);
+        dprintf(1, "malloc zone %s: peak %d, free %d (largest %d),"
+                " fragments %d/%d/%d/%d/%d/%d/%d/%d\n"
+                , zs->name, zs->peak, zs->free, zs->largest
+                , zs->hist[0], zs->hist[1], zs->hist[2], zs->hist[3]
+                , zs->hist[4], zs->hist[5], zs->hist[6], zs->hist[7]);
+    }
+
+    struct malloc_stats_site_s *ss = (void*)zs;
+    for (i=0; i<sites; i++, ss++) {
+        struct malloc_site_s *site = &MallocSites[i];
+        ss->caller = (u32)site->caller;
+        ss->zone = ~0;
+        for (j=0; j<ARRAY_SIZE(Zones); j++)
+            if (Zones[j] == site->zone)
+                ss->zone = j;
+        ss->count = site->count;
+        ss->bytes = site->bytes;
+        if (i < MALLOC_STATS_TOP)
+            dprintf(1, "malloc caller %p: %d bytes in %d allocs from %s\n"
+                    , site->caller, site->bytes, site->count
+                    , site->zone ? ZoneNames[ss->zone] : "(other)");
+    }
+
+    if (CONFIG_QEMU && qemu_cfg_dma_enabled()) {
+        struct romfile_s *file = romfile_find("etc/malloc-stats");
+        if (file)
+            qemu_cfg_write_file(hdr, file, 0
+                                , size < file->size ? size : file->size);
+    }
+    free(hdr);
+}
+
+
+/****************************************************************
+ * malloc interface
+ ****************************************************************/
+
+// Allocate virtual memory from the given zone
+void * __malloc noinline
+_malloc(struct zone_s *zone, u32 size, u32 align)
+{
+    if (CONFIG_MALLOC_STATS && size)
+        malloc_stats_record(zone, size, __builtin_return_address(0));
+    if (size && size <= SLAB_MAX_OBJ && align <= MALLOC_MIN_ALIGN
+        && zone_has_slabs(zone)) {
+        void *data = slab_alloc(zone, size);
+        if (data) {
+            zone->stats.allocs++;
+            return data;
+        }
+    }
+    return memremap(malloc_palloc(zone, size, align), size);
+}
+
 void
 free(void *data)
 {
     if (!data)
         return;
-    int ret = malloc_pfree(virt_to_phys(data));
+    u32 phys = virt_to_phys(data);
+    int ret = malloc_pfree(phys);
+    if (ret)
+        ret = slab_free(phys);
     if (ret)
         warn_internalerror();
 }
@@ -322,29 +653,24 @@ void
 malloc_sethandle(u32 data, u32 handle)
 {
     ASSERT32FLAT();
-    struct allocinfo_s *info = alloc_find(data);
-    if (!info || data == virt_to_phys(info) || !info->alloc_size)
+    struct allocdetail_s *detail = alloc_find(data);
+    if (!detail)
         return;
-    struct allocdetail_s *detail = container_of(
-        info, struct allocdetail_s, datainfo);
+    if (detail->handle != MALLOC_DEFAULT_HANDLE)
+        hlist_del(&detail->handlenode);
     detail->handle = handle;
+    if (handle != MALLOC_DEFAULT_HANDLE)
+        hlist_add_head(&detail->handlenode, &AllocHandles);
 }
 
 // Find the data block allocated with phys_alloc with a given handle.
 u32
 malloc_findhandle(u32 handle)
 {
-    int i;
-    for (i=0; i<ARRAY_SIZE(Zones); i++) {
-        struct allocinfo_s *info;
-        hlist_for_each_entry(info, &Zones[i]->head, node) {
-            if (info->range_start != virt_to_phys(info))
-                continue;
-            struct allocdetail_s *detail = container_of(
-                info, struct allocdetail_s, detailinfo);
-            if (detail->handle == handle)
-                return detail->datainfo.range_start;
-        }
+    struct allocdetail_s *detail;
+    hlist_for_each_entry(detail, &AllocHandles, handlenode) {
+        if (detail->handle == handle)
+            return detail->datainfo.range_start;
     }
     return 0;
 }
@@ -494,12 +820,20 @@ malloc_init(void)
 
     if (CONFIG_RELOCATE_INIT) {
         // Fixup malloc pointers after relocation
-        int i;
+        int i, j;
         for (i=0; i<ARRAY_SIZE(Zones); i++) {
             struct zone_s *zone = Zones[i];
             if (zone->head.first)
                 zone->head.first->pprev = &zone->head.first;
+            for (j=0; j<SLAB_CLASSES; j++)
+                if (zone->slabs[j].first)
+                    zone->slabs[j].first->pprev = &zone->slabs[j].first;
         }
+        for (i=0; i<ALLOC_HASH_SIZE; i++)
+            if (AllocHash[i].first)
+                AllocHash[i].first->pprev = &AllocHash[i].first;
+        if (AllocHandles.first)
+            AllocHandles.first->pprev = &AllocHandles.first;
     }
 
     // Initialize low-memory region
@@ -528,6 +862,16 @@ malloc_prepboot(void)
     ASSERT32FLAT();
     dprintf(3, "malloc finalize\n");
 
+    int i;
+    for (i=0; i<ARRAY_SIZE(Zones); i++) {
+        struct zonestats_s *stats = &Zones[i]->stats;
+        dprintf(3, "zone %s: %d allocs, %d frees, %d bytes in use"
+                " (%d in slab objects)\n", ZoneNames[i], stats->allocs
+                , stats->frees, stats->inuse, stats->slab_inuse);
+    }
+    if (CONFIG_MALLOC_STATS)
+        malloc_stats_report();
+
     u32 base = rom_get_max();
     memset((void*)RomEnd, 0, base-RomEnd);
     if (CONFIG_MALLOC_UPPERMEMORY) {
@@ -129,6 +129,7 @@ device_hardware_setup(void)
     usb_setup();
     ps2port_setup();
     block_setup();
+    boot_probe_setup();
     lpt_setup();
     serial_setup();
     cbfs_payload_setup();
@@ -168,6 +169,7 @@ prepareboot(void)
 
     // Finalize data structures before boot
     cdrom_prepboot();
+    block_prepboot();
     pmm_prepboot();
     malloc_prepboot();
     e820_prepboot();
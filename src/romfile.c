@@ -5,12 +5,30 @@
 // This file may be distributed under the terms of the GNU LGPLv3 license.
 
 #include "config.h" // CONFIG_*
+#include "fw/paravirt.h" // qemu_cfg_read_start
 #include "malloc.h" // free
 #include "output.h" // dprintf
 #include "romfile.h" // struct romfile_s
 #include "string.h" // memcmp
 
+// All files, plus a hash of the file names for exact lookups and an
+// array sorted by name for prefix searches.  The sorted array is
+// rebuilt on the first prefix search after a file is added.
 static struct romfile_s *RomfileRoot VARVERIFY32INIT;
+static struct romfile_s **RomfileHash VARVERIFY32INIT;
+static struct romfile_s **RomfileSorted VARVERIFY32INIT;
+static int RomfileCount, RomfileSortedCount;
+
+#define ROMFILE_HASH_SIZE 128
+
+static u32
+romfile_hash(const char *name)
+{
+    u32 hash = 0;
+    while (*name)
+        hash = hash * 31 + *name++;
+    return hash % ROMFILE_HASH_SIZE;
+}
 
 void
 romfile_add(struct romfile_s *file)
@@ -18,6 +36,75 @@ romfile_add(struct romfile_s *file)
     dprintf(3, "Add romfile: %s (size=%d)\n", file->name, file->size);
     file->next = RomfileRoot;
     RomfileRoot = file;
+    RomfileCount++;
+
+    if (!RomfileHash) {
+        RomfileHash = malloc_tmphigh(ROMFILE_HASH_SIZE * sizeof(RomfileHash[0]));
+        if (!RomfileHash)
+            return;
+        memset(RomfileHash, 0, ROMFILE_HASH_SIZE * sizeof(RomfileHash[0]));
+        // Index the files added before the table was available.
+        struct romfile_s *cur;
+        for (cur = RomfileRoot; cur; cur = cur->next) {
+            u32 hash = romfile_hash(cur->name);
+            cur->hnext = RomfileHash[hash];
+            RomfileHash[hash] = cur;
+        }
+        return;
+    }
+    u32 hash = romfile_hash(file->name);
+    file->hnext = RomfileHash[hash];
+    RomfileHash[hash] = file;
+}
+
+// Find the first position in the sorted array with a name not less
+// than the given name.
+static int
+romfile_lower_bound(const char *name, int count)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(RomfileSorted[mid]->name, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Bring the sorted array up to date.  Returns 0 on allocation failure.
+static int
+romfile_sort(void)
+{
+    if (RomfileSorted && RomfileSortedCount == RomfileCount)
+        return 1;
+    free(RomfileSorted);
+    RomfileSortedCount = 0;
+    RomfileSorted = malloc_tmphigh(RomfileCount * sizeof(RomfileSorted[0]));
+    if (!RomfileSorted)
+        return 0;
+
+    // Binary insertion sort - files with equal names keep the newest
+    // file first, as in the file list.
+    struct romfile_s *cur;
+    int count = 0;
+    for (cur = RomfileRoot; cur; cur = cur->next) {
+        int lo = 0, hi = count;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (strcmp(RomfileSorted[mid]->name, cur->name) <= 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        memmove(&RomfileSorted[lo + 1], &RomfileSorted[lo]
+                , (count - lo) * sizeof(RomfileSorted[0]));
+        RomfileSorted[lo] = cur;
+        count++;
+    }
+    RomfileSortedCount = count;
+    return 1;
 }
 
 // Search for the specified file.
@@ -35,16 +122,38 @@ __romfile_findprefix(const char *prefix, int prefixlen, struct romfile_s *prev)
     return NULL;
 }
 
+// Iterate over the files starting with the given prefix (in name order).
 struct romfile_s *
 romfile_findprefix(const char *prefix, struct romfile_s *prev)
 {
-    return __romfile_findprefix(prefix, strlen(prefix), prev);
+    int prefixlen = strlen(prefix);
+    if (!romfile_sort())
+        return __romfile_findprefix(prefix, prefixlen, prev);
+
+    int count = RomfileSortedCount, pos;
+    if (prev) {
+        pos = romfile_lower_bound(prev->name, count);
+        while (pos < count && RomfileSorted[pos] != prev)
+            pos++;
+        pos++;
+    } else {
+        pos = romfile_lower_bound(prefix, count);
+    }
+    if (pos < count && memcmp(prefix, RomfileSorted[pos]->name, prefixlen) == 0)
+        return RomfileSorted[pos];
+    return NULL;
 }
 
 struct romfile_s *
 romfile_find(const char *name)
 {
-    return __romfile_findprefix(name, strlen(name) + 1, NULL);
+    if (!RomfileHash)
+        return __romfile_findprefix(name, strlen(name) + 1, NULL);
+    struct romfile_s *cur = RomfileHash[romfile_hash(name)];
+    for (; cur; cur = cur->hnext)
+        if (strcmp(name, cur->name) == 0)
+            return cur;
+    return NULL;
 }
 
 // Helper function to find, malloc_tmphigh, and copy a romfile.  This
@@ -78,6 +187,58 @@ romfile_loadfile(const char *name, int *psize)
     return data;
 }
 
+// Start copying a file.  Where the underlying interface supports it
+// (fw_cfg DMA) the copy continues in the background, and the caller
+// may do other work until romfile_copy_wait() is called.  The
+// destination must not be used (or freed) before then.
+void
+romfile_copy_start(struct romfile_req_s *req)
+{
+    req->async = NULL;
+    if (CONFIG_QEMU && qemu_cfg_dma_enabled()) {
+        struct qemu_cfg_dma_s *dma = malloc_tmp(sizeof(*dma));
+        if (dma && qemu_cfg_read_start(dma, req->file, req->dst
+                                       , req->maxlen) == 0) {
+            req->async = dma;
+            return;
+        }
+        free(dma);
+    }
+    req->ret = req->file->copy(req->file, req->dst, req->maxlen);
+}
+
+// Check if a copy started with romfile_copy_start() has completed.
+int
+romfile_copy_poll(struct romfile_req_s *req)
+{
+    return !req->async || qemu_cfg_dma_poll(req->async);
+}
+
+// Wait for a copy started with romfile_copy_start() and return the
+// result of the copy (as with the romfile copy() callback).
+int
+romfile_copy_wait(struct romfile_req_s *req)
+{
+    if (req->async) {
+        req->ret = qemu_cfg_dma_finish(req->async);
+        free(req->async);
+        req->async = NULL;
+    }
+    return req->ret;
+}
+
+// Copy several files, storing each copy() result in its request.  The
+// copies are all started before waiting for any of them.
+void
+romfile_copy_batch(struct romfile_req_s *reqs, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        romfile_copy_start(&reqs[i]);
+    for (i = 0; i < count; i++)
+        romfile_copy_wait(&reqs[i]);
+}
+
 // Attempt to load an integer from the given file - return 'defval'
 // if unsuccessful.
 u64
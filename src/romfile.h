@@ -5,7 +5,7 @@
 
 // romfile.c
 struct romfile_s {
-    struct romfile_s *next;
+    struct romfile_s *next, *hnext;
     char name[128];
     u32 size;
     int (*copy)(struct romfile_s *file, void *dest, u32 maxlen);
@@ -14,6 +14,17 @@ void romfile_add(struct romfile_s *file);
 struct romfile_s *romfile_findprefix(const char *prefix, struct romfile_s *prev);
 struct romfile_s *romfile_find(const char *name);
 void *romfile_loadfile(const char *name, int *psize);
+struct romfile_req_s {
+    struct romfile_s *file;
+    void *dst;
+    u32 maxlen;
+    int ret;
+    void *async;
+};
+void romfile_copy_start(struct romfile_req_s *req);
+int romfile_copy_poll(struct romfile_req_s *req);
+int romfile_copy_wait(struct romfile_req_s *req);
+void romfile_copy_batch(struct romfile_req_s *reqs, int count);
 u64 romfile_loadint(const char *name, u64 defval);
 
 void const_romfile_add_int(char *name, u32 value);
@@ -32,6 +32,10 @@ struct int13ext_s {
     u16 count;
     struct segoff_s data;
     u64 lba;
+    // EDD 3.0 - used when data is 0xffff:0xffff and count is 0xff
+    u64 data_flat;
+    u32 count_flat;
+    u32 reserved2;
 } PACKED;
 
 // DPTE definition
@@ -25,10 +25,12 @@ void boot_add_floppy(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_hd(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_cd(struct drive_s *drive_g, const char *desc, int prio);
 void boot_add_cbfs(void *data, const char *desc, int prio);
+struct pci_device;
+void boot_probe_pci(void (*func)(void *), struct pci_device *pci);
+void boot_probe_setup(void);
 void interactive_bootmenu(void);
 void bcv_prepboot(void);
 u8 is_bootprio_strict(void);
-struct pci_device;
 int bootprio_find_pci_device(struct pci_device *pci);
 int bootprio_find_mmio_device(void *mmio);
 int bootprio_find_scsi_device(struct pci_device *pci, int target, int lun);
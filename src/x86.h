@@ -198,6 +198,10 @@ static inline void smp_rmb(void) {
 static inline void smp_wmb(void) {
     barrier();
 }
+/* Stores may still pass later loads, which a locked operation prevents */
+static inline void smp_mb(void) {
+    asm volatile("lock ; addl $0, (%%esp)" : : : "memory", "cc");
+}
 
 static inline void writel(void *addr, u32 val) {
     barrier();